@@ -173,13 +173,13 @@ class DirWatcherCallback final : public DirWatcherCallbackBase
     virtual void log(action_t action, file_t file, std::string const& name) const override
     {
         if (DirWatcherCallbackBase::UNEXPECTED_ACTION == action && DirWatcherCallbackBase::UNEXPECTED_FILE == file)
-            Logger::logf(Logger::WARNING, __FILE__, __LINE__, "Unexpected action has been detected for unexpected file type: %s", name.c_str());
+            LOGF(Logger::WARNING, "Unexpected action has been detected for unexpected file type: %s", name.c_str());
         else if (DirWatcherCallbackBase::UNEXPECTED_ACTION == action)
-            Logger::logf(Logger::WARNING, __FILE__, __LINE__, "Unexpected action has been detected for %s %s", get_file_str(file), name.c_str());
+            LOGF(Logger::WARNING, "Unexpected action has been detected for %s %s", get_file_str(file), name.c_str());
         else if (DirWatcherCallbackBase::UNEXPECTED_FILE == file)
-            Logger::logf(Logger::WARNING, __FILE__, __LINE__, "Unexpected file %s has been %s", name.c_str(), get_action_str(action));
+            LOGF(Logger::WARNING, "Unexpected file %s has been %s", name.c_str(), get_action_str(action));
         else
-            Logger::logf(Logger::INFO, __FILE__, __LINE__, "%s %s has been %s", get_file_str(file), name.c_str(), get_action_str(action));
+            LOGF(Logger::INFO, "%s %s has been %s", get_file_str(file), name.c_str(), get_action_str(action));
     }
 };
 
@@ -198,7 +198,7 @@ int main(int argc, char** argv)
 
     if(2 != argc)
     {
-	Logger::logf(Logger::ERROR, __FILE__, __LINE__, "Invalid arguments count: %d", argc - 1);
+	LOGF(Logger::ERROR, "Invalid arguments count: %d", argc - 1);
 	exit(EXIT_FAILURE);
     }
     signal(SIGINT, sig_handler);
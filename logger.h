@@ -1,78 +1,1622 @@
+#pragma once
+
 #include <thread>
-#include <iomanip>
 #include <ctime>
 #include <iostream>
 #include <sstream>
-#include <syncstream>
 #include <chrono>
-#include <fstream>
 #include <mutex> 
-#pragma GCC diagnostic ignored "-Wformat-security"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <charconv>
+#include <utility>
+#include <initializer_list>
+#include <vector>
+#include <unordered_map>
+#include <time.h>
+#include <signal.h>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char ** environ;
 
 class Logger
 {
 public:
 	
-enum severity_t { INFO, WARNING, ERROR, FATAL, DEBUG };
+enum severity_t { DEBUG, INFO, WARNING, ERROR, FATAL };
+
+enum overflow_policy_t { BLOCK, DROP_NEWEST, DROP_OLDEST };
+
+enum timestamp_precision_t { SECONDS, MILLISECONDS, MICROSECONDS };
+
+        static constexpr std::size_t record_capacity = 1024;
+
+        static constexpr std::size_t max_sinks = 8;
+
+        static constexpr std::size_t flight_text_capacity = 200;
+
+        // A zero max_bytes or interval disables the corresponding trigger.
+        struct rotation_t
+        {
+                std::size_t max_bytes;
+                std::chrono::seconds interval;
+                bool compress;
+        };
+
+        // Value types of structured record fields, as encoded by kv().
+        enum field_type_t : std::uint8_t { FIELD_INT, FIELD_UINT, FIELD_DOUBLE, FIELD_BOOL, FIELD_STRING };
+
+        // A record as handed to a sink for rendering. Structured records (see
+        // log()) carry an event name and their encoded fields instead of a
+        // message; walk the fields with for_each_field().
+        struct Entry
+        {
+                severity_t severity;
+                timespec time;
+                std::thread::id thread_id;
+                char const * file;
+                std::size_t line;
+                std::string_view message;
+                char const * event;
+                std::string_view fields;
+        };
+
+        struct FieldView
+        {
+                field_type_t type;
+                std::string_view key;
+                std::int64_t int_value;
+                std::uint64_t uint_value;
+                double double_value;
+                bool bool_value;
+                std::string_view string_value;
+        };
+
+        // A key/value pair for log(); the value is only referenced until the
+        // record is encoded.
+        template<class T>
+        struct Field
+        {
+                char const * key;
+                T const& value;
+        };
+
+        template<class T>
+        static Field<T> kv(char const * key, T const& value)
+        {
+                return Field<T>{ key, value };
+        }
+
+
+        // State of one LOGF() call site, keyed on FILE/LINE. Limits are configured
+        // at runtime through set_rate_limit() and set_sampling(); an unlimited site
+        // costs a single relaxed load. A site is a source location, so its limits
+        // are process-wide, whichever logger the call targets; suppressions are
+        // reported to the logger of the admitted call.
+        class CallSite
+        {
+                friend class Logger;
+
+                enum mode_t : std::uint32_t { RATE_LIMITED = 1, SAMPLED = 2 };
+
+                char const * const m_file;
+                std::size_t const m_line;
+                CallSite * m_next;
+                std::atomic<std::uint32_t> m_mode;
+                std::atomic<std::uint64_t> m_interval_ns;
+                std::atomic<std::uint64_t> m_tolerance_ns;
+                std::atomic<std::uint32_t> m_sample_every;
+                std::atomic<std::uint64_t> m_arrival_ns;
+                std::atomic<std::uint64_t> m_sample_count;
+                std::atomic<std::uint64_t> m_suppressed;
+                std::atomic<std::uint64_t> m_reported_ns;
+
+                bool admit_limited(std::uint32_t mode, Logger& logger);
+
+        public:
+                CallSite(char const * file, std::size_t line);
+
+                CallSite(CallSite const&) = delete;
+
+                CallSite& operator=(CallSite const&) = delete;
+
+                bool admit(Logger& logger)
+                {
+                        std::uint32_t mode = m_mode.load(std::memory_order_relaxed);
+                        return 0 == mode || true == this->admit_limited(mode, logger);
+                }
+        };
+
+private:
+
+        struct Record;
+
+        // Formats the message of a deferred record; null for records whose message
+        // was already formatted by the caller.
+        using decoder_t = void (*)(Record const&, std::string&);
+
+        // Formats raw arguments into out, truncated to capacity, and returns the
+        // length written; used by the flight recorder, which formats at dump time.
+        using formatter_t = std::size_t (*)(char const * fmt, char const * data, char * out, std::size_t capacity);
+
+        // One raw argument, widened for format_signal_safe(). Integers and
+        // pointers keep their bits and promoted size, so that each conversion
+        // reinterprets them the way printf() would.
+        struct RawArg
+        {
+                enum kind_t : std::uint8_t { INTEGER, FLOATING, LONG_DOUBLE, STRING };
+
+                kind_t kind;
+                std::uint8_t size;
+                unsigned long long bits;
+                double double_value;
+                long double long_double_value;
+                char const * string_value;
+        };
+
+        struct Record
+        {
+                severity_t severity;
+                char const * file;
+                std::size_t line;
+                timespec time;
+                std::thread::id thread_id;
+                char const * fmt;
+                char const * event;
+                decoder_t decoder;
+                formatter_t formatter;
+                std::size_t size;
+                char data[record_capacity];
+                // The whole message when it is longer than data, which then only
+                // holds its beginning; shared by every sink the record goes to.
+                std::shared_ptr<std::string const> overflow;
+        };
+
+        template<class A>
+        static constexpr bool is_cstring_v = std::is_same_v<A, char const *> || std::is_same_v<A, char *>;
+
+        template<class T>
+        using stored_t = std::conditional_t<is_cstring_v<std::decay_t<T>>, char const *, std::decay_t<T>>;
+
+        // Bounded MPMC queue (D. Vyukov). Consumers are the sink's writer thread
+        // and, under DROP_OLDEST, producers evicting the oldest record.
+        class RingBuffer
+        {
+                struct Cell
+                {
+                        std::atomic<std::size_t> sequence;
+                        Record record;
+                };
+
+                std::unique_ptr<Cell[]> m_buffer;
+                std::size_t const m_mask;
+                alignas(64) std::atomic<std::size_t> m_enqueue_pos;
+                alignas(64) std::atomic<std::size_t> m_dequeue_pos;
+
+                static std::size_t round_up(std::size_t capacity)
+                {
+                        std::size_t res = 2;
+                        while(res < capacity)
+                                res <<= 1;
+                        return res;
+                }
+
+        public:
+                explicit RingBuffer(std::size_t capacity)
+                        : m_buffer(new Cell[round_up(capacity)])
+                        , m_mask(round_up(capacity) - 1)
+                        , m_enqueue_pos(0)
+                        , m_dequeue_pos(0)
+                {
+                        for(std::size_t i = 0; i <= m_mask; ++i)
+                                m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+                }
+
+                template<class F>
+                bool try_push(F&& fill)
+                {
+                        std::size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+                        while(true)
+                        {
+                                Cell& cell = m_buffer[pos & m_mask];
+                                std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+                                std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+                                if(0 == diff)
+                                {
+                                        if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                                        {
+                                                fill(cell.record);
+                                                cell.sequence.store(pos + 1, std::memory_order_release);
+                                                return true;
+                                        }
+                                }
+                                else if(diff < 0)
+                                        return false;
+                                else
+                                        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+                        }
+                }
+
+                template<class F>
+                bool try_pop(F&& consume)
+                {
+                        std::size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+                        while(true)
+                        {
+                                Cell& cell = m_buffer[pos & m_mask];
+                                std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+                                std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+                                if(0 == diff)
+                                {
+                                        if(m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                                        {
+                                                consume(cell.record);
+                                                cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+                                                return true;
+                                        }
+                                }
+                                else if(diff < 0)
+                                        return false;
+                                else
+                                        pos = m_dequeue_pos.load(std::memory_order_relaxed);
+                        }
+                }
+        };
+
+        struct SiteRule
+        {
+                std::string file;
+                std::size_t line;
+                double per_second;
+                std::size_t burst;
+                std::uint32_t sample_every;
+        };
+
+        // One slot of a flight recorder buffer, guarded by a sequence lock: seq is
+        // odd while the owning thread rewrites the slot.
+        struct FlightSlot
+        {
+                std::atomic<std::uint64_t> seq;
+                timespec time;
+                unsigned long thread_id;
+                char const * file;
+                std::size_t line;
+                severity_t severity;
+                // Raw arguments of fmt, the encoded fields of event, or else text.
+                char const * fmt;
+                char const * event;
+                formatter_t formatter;
+                std::size_t size;
+                char data[flight_text_capacity];
+        };
+
+        // Circular buffer of the last records of one thread. Only its owner
+        // writes to it. Buffers are never freed; once their owner exits they
+        // are handed over to the next thread that logs.
+        struct FlightBuffer
+        {
+                FlightBuffer * next;
+                std::atomic<bool> in_use;
+                std::atomic<std::uint64_t> head;
+                std::size_t const capacity;
+                std::unique_ptr<FlightSlot[]> const slots;
+
+                explicit FlightBuffer(std::size_t capacity_param)
+                        : next(nullptr)
+                        , in_use(true)
+                        , head(0)
+                        , capacity(capacity_param)
+                        , slots(new FlightSlot[capacity_param]{})
+                {
+                }
+        };
+
+        struct FlightHandle
+        {
+                FlightBuffer * buffer = nullptr;
+
+                ~FlightHandle(void)
+                {
+                        if(nullptr != buffer)
+                                buffer->in_use.store(false, std::memory_order_release);
+                }
+        };
+
+        // Raw O_APPEND output with writev batching. When rotation is enabled the
+        // file is renamed with a timestamp suffix and reopened, and rotated files
+        // can be handed to a background gzip.
+        class FileWriter
+        {
+                std::string const m_path;
+                int m_fd;
+                std::mutex m_mutex;
+                rotation_t m_rotation;
+                std::size_t m_size;
+                std::time_t m_period;
+                std::vector<pid_t> m_compressors;
+                bool m_rotation_failed;
+
+                bool open_file(void)
+                {
+                        int fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                        if(0 > fd)
+                                return false;
+                        if(STDOUT_FILENO != m_fd)
+                                ::close(m_fd);
+                        m_fd = fd;
+                        struct stat st;
+                        m_size = 0 == fstat(m_fd, &st) ? st.st_size : 0;
+                        return true;
+                }
+
+                // Reported once on stderr, the sink itself being the broken part.
+                void rotation_failed(char const * what)
+                {
+                        if(false == m_rotation_failed)
+                                std::fprintf(stderr, "Logger: cannot %s %s (%s), writing on to the current file\n", what, m_path.c_str(), strerror(errno));
+                        m_rotation_failed = true;
+                }
+
+                std::time_t period(std::time_t now) const
+                {
+                        return 0 == m_rotation.interval.count() ? 0 : now - now % m_rotation.interval.count();
+                }
+
+                void reap_compressors(bool wait)
+                {
+                        for(auto it = m_compressors.begin(); it != m_compressors.end();)
+                        {
+                                if(0 != waitpid(*it, nullptr, wait ? 0 : WNOHANG))
+                                        it = m_compressors.erase(it);
+                                else
+                                        ++it;
+                        }
+                }
+
+                // On failure, keeps writing to the current file, counting it as
+                // empty so that write() still makes progress.
+                void rotate(std::time_t now)
+                {
+                        char suffix[32];
+                        std::tm local;
+                        localtime_r(&now, &local);
+                        std::strftime(suffix, sizeof(suffix), ".%Y%m%d%H%M%S", &local);
+                        std::string rotated = m_path + suffix;
+                        for(int i = 1; 0 == access(rotated.c_str(), F_OK) || 0 == access((rotated + ".gz").c_str(), F_OK); ++i)
+                                rotated = m_path + suffix + "." + std::to_string(i);
+
+                        if(0 > rename(m_path.c_str(), rotated.c_str()))
+                        {
+                                this->rotation_failed("rename");
+                                m_size = 0;
+                                return;
+                        }
+                        if(false == this->open_file())
+                        {
+                                this->rotation_failed("reopen");
+                                m_size = 0;
+                                return;
+                        }
+
+                        reap_compressors(false);
+                        if(true == m_rotation.compress)
+                        {
+                                pid_t pid;
+                                char const * argv[] = { "gzip", "-f", rotated.c_str(), nullptr };
+                                if(0 == posix_spawnp(&pid, "gzip", nullptr, nullptr, const_cast<char * const *>(argv), environ))
+                                        m_compressors.push_back(pid);
+                        }
+                }
+
+                void write_all(iovec * iov, int count)
+                {
+                        while(count > 0)
+                        {
+                                ssize_t res = ::writev(m_fd, iov, count);
+                                if(0 > res)
+                                {
+                                        if(EINTR == errno)
+                                                continue;
+                                        return;
+                                }
+                                m_size += res;
+                                while(count > 0 && static_cast<std::size_t>(res) >= iov->iov_len)
+                                {
+                                        res -= iov->iov_len;
+                                        ++iov;
+                                        --count;
+                                }
+                                if(count > 0)
+                                {
+                                        iov->iov_base = static_cast<char *>(iov->iov_base) + res;
+                                        iov->iov_len -= res;
+                                }
+                        }
+                }
+
+        public:
+                // A null path writes to the standard output, which is never rotated.
+                explicit FileWriter(char const * path)
+                        : m_path(path ? path : "")
+                        , m_fd(STDOUT_FILENO)
+                        , m_rotation{ 0, std::chrono::seconds(0), false }
+                        , m_size(0)
+                        , m_period(0)
+                        , m_rotation_failed(false)
+                {
+                        if(nullptr != path && false == this->open_file())
+                                throw std::runtime_error(strerror(errno));
+                }
+
+                ~FileWriter(void)
+                {
+                        if(false == m_path.empty())
+                                ::close(m_fd);
+                        reap_compressors(true);
+                }
+
+                FileWriter(FileWriter const&) = delete;
+
+                FileWriter& operator=(FileWriter const&) = delete;
+
+                void set_rotation(rotation_t rotation)
+                {
+                        std::lock_guard<std::mutex> lg(m_mutex);
+                        m_rotation = rotation;
+                        m_period = period(std::time(nullptr));
+                }
+
+                // Writes whole records, one per iovec, rotating between records.
+                void write(iovec * iov, std::size_t count)
+                {
+                        std::lock_guard<std::mutex> lg(m_mutex);
+                        bool const rotating = false == m_path.empty() && (0 != m_rotation.max_bytes || 0 != m_rotation.interval.count());
+                        if(true == rotating && 0 != m_rotation.interval.count())
+                        {
+                                std::time_t now = std::time(nullptr);
+                                if(period(now) != m_period)
+                                {
+                                        m_period = period(now);
+                                        if(0 != m_size)
+                                                this->rotate(now);
+                                }
+                        }
+
+                        while(0 != count)
+                        {
+                                std::size_t n = 0;
+                                std::size_t size = m_size;
+                                while(n < count && n < IOV_MAX && (false == rotating || 0 == m_rotation.max_bytes || 0 == size || size + iov[n].iov_len <= m_rotation.max_bytes))
+                                        size += iov[n++].iov_len;
+                                if(0 == n)
+                                {
+                                        this->rotate(std::time(nullptr));
+                                        continue;
+                                }
+                                this->write_all(iov, n);
+                                iov += n;
+                                count -= n;
+                        }
+                }
+        };
+
+public:
+
+        // Destination for records. Each sink filters on its own severity and, when
+        // created with a non-zero async capacity, owns a ring and a writer thread,
+        // so a slow sink only ever backs up its own ring. Without one, records are
+        // written on the caller's thread.
+        class Sink
+        {
+                friend class Logger;
+
+                std::atomic<severity_t> m_min_severity;
+                overflow_policy_t const m_overflow_policy;
+                std::size_t const m_async_capacity;
+                std::unique_ptr<RingBuffer> m_ring;
+                std::atomic<std::uint64_t> m_dropped;
+                std::atomic<std::uint32_t> m_writer_epoch;
+                std::atomic<bool> m_writer_sleeping;
+                std::atomic<bool> m_writer_stop_requested;
+                std::thread m_writer;
+                std::mutex m_mutex;
+                std::string m_batch;
+                std::vector<std::size_t> m_ends;
+                std::vector<iovec> m_iov;
+                std::string m_message;
+                std::unordered_map<std::thread::id, std::string> m_thread_ids;
+
+                void start(void)
+                {
+                        if(0 != m_async_capacity && !m_ring)
+                        {
+                                m_ring.reset(new RingBuffer(m_async_capacity));
+                                m_writer = std::thread(&Sink::writer_loop, this);
+                        }
+                }
+
+                void stop(void)
+                {
+                        if(m_writer.joinable())
+                        {
+                                m_writer_stop_requested.store(true, std::memory_order_seq_cst);
+                                wake_writer();
+                                m_writer.join();
+                        }
+                }
+
+                void push(Record const& record)
+                {
+                        if(!m_ring)
+                        {
+                                std::lock_guard<std::mutex> lg(m_mutex);
+                                this->append(record);
+                                this->flush();
+                                return;
+                        }
+
+                        auto fill = [&record](Record& slot) { copy_record(slot, record); };
+                        while(false == m_ring->try_push(fill))
+                        {
+                                if(DROP_NEWEST == m_overflow_policy)
+                                {
+                                        m_dropped.fetch_add(1, std::memory_order_relaxed);
+                                        return;
+                                }
+                                if(DROP_OLDEST == m_overflow_policy)
+                                {
+                                        if(true == m_ring->try_pop([](Record& oldest) { oldest.overflow.reset(); }))
+                                                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                                        continue;
+                                }
+                                wake_writer();
+                                std::this_thread::yield();
+                        }
+                        std::atomic_thread_fence(std::memory_order_seq_cst);
+                        if(true == m_writer_sleeping.load(std::memory_order_relaxed))
+                                wake_writer();
+                }
+
+                void append(Record const& record)
+                {
+                        Entry entry{ record.severity, record.time, record.thread_id, record.file, record.line, {}, record.event, {} };
+                        if(nullptr == record.event)
+                                entry.message = message_of(record, m_message);
+                        else
+                                entry.fields = std::string_view(record.data, record.size);
+                        this->render(entry, m_batch);
+                        m_ends.push_back(m_batch.size());
+                }
+
+                void append_dropped(std::uint64_t count)
+                {
+                        m_message = "Logger dropped " + std::to_string(count) + " record(s) on overflow";
+                        Entry entry{ WARNING, now(), std::this_thread::get_id(), __FILE__, __LINE__, m_message, nullptr, {} };
+                        this->render(entry, m_batch);
+                        m_ends.push_back(m_batch.size());
+                }
+
+                void flush(void)
+                {
+                        m_iov.clear();
+                        std::size_t begin = 0;
+                        for(std::size_t end : m_ends)
+                        {
+                                m_iov.push_back(iovec{ m_batch.data() + begin, end - begin });
+                                begin = end;
+                        }
+                        this->write(m_iov.data(), m_iov.size());
+                        m_batch.clear();
+                        m_ends.clear();
+                }
+
+                void wake_writer(void)
+                {
+                        m_writer_epoch.fetch_add(1, std::memory_order_release);
+                        m_writer_epoch.notify_one();
+                }
+
+                // Drains the ring in batches of up to max_batch records, each batch
+                // handed to write() at once. Exits only once a stop was requested and
+                // the ring is empty. Nothing may escape the thread: records failing
+                // to render or write are dropped and counted instead.
+                void writer_loop(void)
+                {
+                        static constexpr std::size_t max_batch = 256;
+                        std::uint64_t reported_dropped = 0;
+                        auto append = [this](Record& record)
+                        {
+                                std::size_t const size = m_batch.size();
+                                try
+                                {
+                                        this->append(record);
+                                }
+                                catch(...)
+                                {
+                                        m_batch.resize(size);
+                                        m_dropped.fetch_add(1, std::memory_order_relaxed);
+                                }
+                                record.overflow.reset();
+                        };
+
+                        while(true)
+                        {
+                                std::uint32_t epoch = m_writer_epoch.load(std::memory_order_acquire);
+                                while(m_ends.size() < max_batch && true == m_ring->try_pop(append))
+                                        ;
+
+                                std::uint64_t cur_dropped = m_dropped.load(std::memory_order_relaxed);
+                                if(cur_dropped != reported_dropped)
+                                {
+                                        try
+                                        {
+                                                this->append_dropped(cur_dropped - reported_dropped);
+                                        }
+                                        catch(...)
+                                        {
+                                        }
+                                        reported_dropped = cur_dropped;
+                                }
+
+                                if(false == m_ends.empty())
+                                {
+                                        try
+                                        {
+                                                this->flush();
+                                        }
+                                        catch(...)
+                                        {
+                                                // Counted as reported, a failing sink would only
+                                                // keep failing to write the notice.
+                                                m_dropped.fetch_add(m_ends.size(), std::memory_order_relaxed);
+                                                reported_dropped += m_ends.size();
+                                                m_batch.clear();
+                                                m_ends.clear();
+                                        }
+                                        continue;
+                                }
+
+                                if(true == m_writer_stop_requested.load(std::memory_order_acquire))
+                                        break;
+
+                                m_writer_sleeping.store(true, std::memory_order_seq_cst);
+                                std::atomic_thread_fence(std::memory_order_seq_cst);
+                                if(false == m_ring->try_pop(append))
+                                        m_writer_epoch.wait(epoch, std::memory_order_acquire);
+                                m_writer_sleeping.store(false, std::memory_order_relaxed);
+                        }
+                }
+
+        protected:
+                Sink(severity_t min_severity, std::size_t async_capacity, overflow_policy_t overflow_policy)
+                        : m_min_severity(min_severity)
+                        , m_overflow_policy(overflow_policy)
+                        , m_async_capacity(async_capacity)
+                        , m_dropped(0)
+                        , m_writer_epoch(0)
+                        , m_writer_sleeping(false)
+                        , m_writer_stop_requested(false)
+                {
+                }
+
+                // Appends the rendered entry, including its line terminator.
+                virtual void render(Entry const& entry, std::string& out) = 0;
+
+                // Writes a batch of rendered entries, one per iovec.
+                virtual void write(iovec * iov, std::size_t count) = 0;
+
+                // Records rendered by a writer thread come from other threads, so
+                // their ids are rendered once and kept; the map is dropped whenever
+                // it reaches max_thread_ids, so that thread churn cannot grow it.
+                std::string_view thread_id_str(std::thread::id thread_id)
+                {
+                        static constexpr std::size_t max_thread_ids = 1024;
+                        if(std::this_thread::get_id() == thread_id)
+                                return this_thread_id_str();
+                        auto it = m_thread_ids.find(thread_id);
+                        if(m_thread_ids.end() != it)
+                                return it->second;
+                        if(max_thread_ids <= m_thread_ids.size())
+                                m_thread_ids.clear();
+                        return m_thread_ids.emplace(thread_id, Logger::thread_id_str(thread_id)).first->second;
+                }
+
+        public:
+                // Derived sinks must call stop() in their destructors, so that the
+                // writer thread never renders through a partially destroyed sink.
+                virtual ~Sink(void)
+                {
+                        this->stop();
+                }
+
+                Sink(Sink const&) = delete;
+
+                Sink& operator=(Sink const&) = delete;
+
+                void set_min_severity(severity_t severity)
+                {
+                        m_min_severity.store(severity, std::memory_order_relaxed);
+                }
+
+                bool accepts(severity_t severity) const
+                {
+                        return severity >= m_min_severity.load(std::memory_order_relaxed);
+                }
+
+                std::uint64_t dropped_count(void) const
+                {
+                        return m_dropped.load(std::memory_order_relaxed);
+                }
+        };
+
+        // Text lines written to a file, or to the standard output for a null path.
+        class FileSink : public Sink
+        {
+                FileWriter m_output;
+                bool const m_colored;
+                bool const m_show_source;
+
+        protected:
+                void render(Entry const& entry, std::string& out) override
+                {
+                        render_text(entry, m_colored, m_show_source, this->thread_id_str(entry.thread_id), out);
+                }
+
+                void write(iovec * iov, std::size_t count) override
+                {
+                        m_output.write(iov, count);
+                }
+
+        public:
+                explicit FileSink(char const * path, severity_t min_severity = DEBUG, bool colored = false, bool show_source = true, std::size_t async_capacity = 0, overflow_policy_t overflow_policy = BLOCK)
+                        : Sink(min_severity, async_capacity, overflow_policy)
+                        , m_output(path)
+                        , m_colored(colored)
+                        , m_show_source(show_source)
+                {
+                }
+
+                ~FileSink(void)
+                {
+                        this->stop();
+                }
+
+                // Enables size- and/or time-based rotation; it runs on the writer
+                // thread for async sinks.
+                void set_rotation(rotation_t rotation)
+                {
+                        m_output.set_rotation(rotation);
+                }
+        };
+
+        class ConsoleSink final : public FileSink
+        {
+        public:
+                explicit ConsoleSink(severity_t min_severity = DEBUG, bool colored = true, bool show_source = true, std::size_t async_capacity = 0, overflow_policy_t overflow_policy = BLOCK)
+                        : FileSink(nullptr, min_severity, colored, show_source, async_capacity, overflow_policy)
+                {
+                }
+        };
+
+        // One JSON object per line.
+        class JsonSink final : public FileSink
+        {
+        protected:
+                void render(Entry const& entry, std::string& out) override
+                {
+                        char buf[32];
+                        out += "{\"time\":";
+                        out.append(buf, std::to_chars(buf, buf + sizeof(buf), entry.time.tv_sec).ptr);
+                        out += '.';
+                        long fraction = entry.time.tv_nsec / 1000;
+                        for(int i = 5; i >= 0; --i, fraction /= 10)
+                                buf[i] = '0' + fraction % 10;
+                        out.append(buf, 6);
+                        out += ",\"thread\":\"";
+                        out += this->thread_id_str(entry.thread_id);
+                        out += "\",\"severity\":\"";
+                        out += get_severity_str(entry.severity);
+                        out += "\",\"file\":";
+                        append_json_string(out, entry.file);
+                        out += ",\"line\":";
+                        out.append(buf, std::to_chars(buf, buf + sizeof(buf), entry.line).ptr);
+                        if(nullptr == entry.event)
+                        {
+                                out += ",\"message\":";
+                                append_json_string(out, entry.message);
+                        }
+                        else
+                        {
+                                out += ",\"event\":";
+                                append_json_string(out, entry.event);
+                                for_each_field(entry.fields, [&out](FieldView const& field) { append_json_field(out, field); });
+                        }
+                        out += "}\n";
+                }
+
+        public:
+                explicit JsonSink(char const * path, severity_t min_severity = DEBUG, std::size_t async_capacity = 0, overflow_policy_t overflow_policy = BLOCK)
+                        : FileSink(path, min_severity, false, true, async_capacity, overflow_policy)
+                {
+                }
+
+                ~JsonSink(void)
+                {
+                        this->stop();
+                }
+        };
+
+        // Compact binary frames in native byte order: u32 size of the rest of the
+        // frame, i64 seconds, u32 nanoseconds, u8 severity, u32 line, then the
+        // file, thread id and event as u16-length-prefixed strings, followed by
+        // the fields as encoded by kv(). A printf-style record is framed with an
+        // empty event and a single "message" string field.
+        class BinarySink final : public FileSink
+        {
+                template<class A>
+                static void append_raw(std::string& out, A value)
+                {
+                        out.append(reinterpret_cast<char const *>(&value), sizeof(value));
+                }
+
+                static void append_str(std::string& out, std::string_view str)
+                {
+                        str = str.substr(0, UINT16_MAX);
+                        append_raw(out, static_cast<std::uint16_t>(str.size()));
+                        out += str;
+                }
+
+        protected:
+                void render(Entry const& entry, std::string& out) override
+                {
+                        std::size_t begin = out.size();
+                        append_raw(out, std::uint32_t(0));
+                        append_raw(out, static_cast<std::int64_t>(entry.time.tv_sec));
+                        append_raw(out, static_cast<std::uint32_t>(entry.time.tv_nsec));
+                        append_raw(out, static_cast<std::uint8_t>(entry.severity));
+                        append_raw(out, static_cast<std::uint32_t>(entry.line));
+                        append_str(out, entry.file);
+                        append_str(out, this->thread_id_str(entry.thread_id));
+                        if(nullptr == entry.event)
+                        {
+                                append_str(out, std::string_view());
+                                append_raw(out, static_cast<std::uint8_t>(FIELD_STRING));
+                                append_raw(out, std::uint8_t(7));
+                                out += "message";
+                                append_str(out, entry.message);
+                        }
+                        else
+                        {
+                                append_str(out, entry.event);
+                                out += entry.fields;
+                        }
+                        std::uint32_t size = out.size() - begin - sizeof(std::uint32_t);
+                        std::memcpy(out.data() + begin, &size, sizeof(size));
+                }
+
+        public:
+                explicit BinarySink(char const * path, severity_t min_severity = DEBUG, std::size_t async_capacity = 0, overflow_policy_t overflow_policy = BLOCK)
+                        : FileSink(path, min_severity, false, true, async_capacity, overflow_policy)
+                {
+                }
+
+                ~BinarySink(void)
+                {
+                        this->stop();
+                }
+        };
+
+        // Keeps the last capacity rendered lines in memory, e.g. to be dumped
+        // after a failure.
+        class MemorySink final : public Sink
+        {
+                mutable std::mutex m_lines_mutex;
+                std::vector<std::string> m_lines;
+                std::size_t m_next;
+                bool const m_show_source;
+
+        protected:
+                void render(Entry const& entry, std::string& out) override
+                {
+                        render_text(entry, false, m_show_source, this->thread_id_str(entry.thread_id), out);
+                }
+
+                void write(iovec * iov, std::size_t count) override
+                {
+                        std::lock_guard<std::mutex> lg(m_lines_mutex);
+                        for(std::size_t i = 0; i < count; ++i, ++m_next)
+                                m_lines[m_next % m_lines.size()].assign(static_cast<char const *>(iov[i].iov_base), iov[i].iov_len);
+                }
+
+        public:
+                explicit MemorySink(std::size_t capacity, severity_t min_severity = DEBUG, bool show_source = true, std::size_t async_capacity = 0, overflow_policy_t overflow_policy = DROP_OLDEST)
+                        : Sink(min_severity, async_capacity, overflow_policy)
+                        , m_lines(0 == capacity ? 1 : capacity)
+                        , m_next(0)
+                        , m_show_source(show_source)
+                {
+                }
+
+                ~MemorySink(void)
+                {
+                        this->stop();
+                }
+
+                // Retained lines, oldest first.
+                std::vector<std::string> snapshot(void) const
+                {
+                        std::lock_guard<std::mutex> lg(m_lines_mutex);
+                        std::vector<std::string> res;
+                        std::size_t begin = m_next > m_lines.size() ? m_next - m_lines.size() : 0;
+                        for(std::size_t i = begin; i < m_next; ++i)
+                                res.push_back(m_lines[i % m_lines.size()]);
+                        return res;
+                }
+
+                void dump(int fd) const
+                {
+                        for(auto const& line : this->snapshot())
+                                if(0 > ::write(fd, line.data(), line.size()))
+                                        return;
+                }
+        };
 
 private:
 
         static inline Logger* this_ptr = nullptr;
-        std::ofstream outf;
-        std::ostream& out;
-	bool const debug;
-	bool const show_source;
-	bool const colored;
+        static inline std::atomic<timestamp_precision_t> timestamp_precision = SECONDS;
+        static inline std::atomic<bool> flight_recording = false;
+        static inline std::atomic<std::size_t> flight_capacity = 0;
+        static inline std::atomic<FlightBuffer*> flight_buffers = nullptr;
+        static inline std::atomic<bool> crashing = false;
+        static inline char crash_dump_path[PATH_MAX] = {};
+        static inline std::mutex sites_mutex;
+        static inline CallSite* sites = nullptr;
+        static inline std::vector<SiteRule> site_rules;
+        std::unique_ptr<Sink> sinks[max_sinks];
+        std::atomic<std::size_t> sink_count;
+        std::mutex sinks_mutex;
+        std::atomic<bool> deferred;
+        std::atomic<severity_t> min_severity;
+        std::atomic<severity_t> toggled_severity;
 
 
 public:
+        // Creates a logger without sinks; attach them with add_sink(). The first
+        // logger created becomes the default one, used by LOGF() and logf().
+        Logger(void)
+                : sink_count(0)
+                , deferred(false)
+                , min_severity(DEBUG)
+                , toggled_severity(DEBUG)
+        {
+                if(nullptr == this_ptr)
+                        this_ptr = this;
+        }
+
         Logger(char const * filename, bool debug_param = true, bool show_source_param = true, bool colored_param = true)
-                : outf(filename)
-		, out(filename ?
-                        outf : std::cout)
-		, debug(debug_param)
-		, show_source(show_source_param)
-		, colored(colored_param)
-        {
-                if(NULL != this_ptr)
-                        throw std::runtime_error("Only one instance of Logger can be created");
-                this_ptr = this;
+                : Logger(filename, debug_param, show_source_param, colored_param, 0)
+        {
+        }
+
+        // Creates a logger with a single FileSink (the standard output for a null
+        // filename). A non-zero async_capacity gives the sink a ring of that many
+        // slots drained by its own writer thread. With deferred_param set, logf()
+        // only captures the format pointer and the raw arguments, and formatting
+        // happens on the writer thread.
+        Logger(char const * filename, bool debug_param, bool show_source_param, bool colored_param, std::size_t async_capacity, overflow_policy_t overflow_policy_param = BLOCK, bool deferred_param = false)
+                : Logger()
+        {
+                min_severity.store(debug_param ? DEBUG : INFO, std::memory_order_relaxed);
+                deferred.store(deferred_param && 0 != async_capacity, std::memory_order_relaxed);
+                this->add_sink(std::make_unique<FileSink>(filename, DEBUG, colored_param, show_source_param, async_capacity, overflow_policy_param));
         }
 
         ~Logger()
         {
-		out << std::flush;
-                outf.close();
-                this_ptr = nullptr;
+                if(this == this_ptr)
+                        report_suppressed();
+                for(std::size_t i = 0; i < sink_count.load(std::memory_order_acquire); ++i)
+                        sinks[i]->stop();
+                if(this == this_ptr)
+                        this_ptr = nullptr;
+        }
+
+	Logger(const Logger&) = delete;
+
+        Logger& operator=(const Logger&) = delete;
+
+        Logger(Logger&&) = delete;
+
+        Logger& operator=(Logger&&) = delete;
+
+
+        // printf-style format string parsed and checked against the argument types
+        // at compile time. The parse result is kept in the object, so formatting
+        // only walks the precomputed literals and conversions.
+        template<class ...A>
+        class format_string
+        {
+                enum arg_kind_t { INTEGER, FLOATING, LONG_DOUBLE, STRING, POINTER, UNSUPPORTED };
+
+                struct ArgInfo
+                {
+                        arg_kind_t kind;
+                        std::size_t size;
+                };
+
+                struct Literal
+                {
+                        std::size_t begin;
+                        std::size_t size;
+                        bool escaped;
+                };
+
+                struct Conversion
+                {
+                        char spec[16];
+                        char conversion;
+                        int precision;
+                        bool simple;
+                };
+
+                char const * m_str;
+                Literal m_literals[sizeof...(A) + 1];
+                Conversion m_conversions[sizeof...(A) + 1];
+
+                // Not constexpr: reaching it during constant evaluation is what
+                // turns a bad format string into a compile error.
+                static void format_error(char const *) {}
+
+                template<class T>
+                static consteval ArgInfo arg_info(void)
+                {
+                        if constexpr (is_cstring_v<T>)
+                                return { STRING, sizeof(T) };
+                        else if constexpr (std::is_enum_v<T>)
+                                return arg_info<std::underlying_type_t<T>>();
+                        else if constexpr (std::is_integral_v<T>)
+                                return { INTEGER, sizeof(T) < sizeof(int) ? sizeof(int) : sizeof(T) };
+                        else if constexpr (std::is_same_v<T, long double>)
+                                return { LONG_DOUBLE, sizeof(T) };
+                        else if constexpr (std::is_floating_point_v<T>)
+                                return { FLOATING, sizeof(double) };
+                        else if constexpr (std::is_pointer_v<T> || std::is_null_pointer_v<T>)
+                                return { POINTER, sizeof(void *) };
+                        else
+                                return { UNSUPPORTED, 0 };
+                }
+
+                static consteval std::size_t integer_size(char const * length)
+                {
+                        if('\0' == length[0] || 'h' == length[0])
+                                return sizeof(int);
+                        if('l' == length[0])
+                                return 'l' == length[1] ? sizeof(long long) : sizeof(long);
+                        if('z' == length[0])
+                                return sizeof(std::size_t);
+                        if('j' == length[0])
+                                return sizeof(std::intmax_t);
+                        if('t' == length[0])
+                                return sizeof(std::ptrdiff_t);
+                        return 0;
+                }
+
+                static consteval void check(char conversion, char const * length, ArgInfo arg)
+                {
+                        switch(conversion)
+                        {
+                        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+                                if(INTEGER != arg.kind || integer_size(length) != arg.size)
+                                        format_error("integer conversion does not match the argument type");
+                                break;
+                        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                                if(('L' == length[0] ? LONG_DOUBLE : FLOATING) != arg.kind)
+                                        format_error("floating point conversion does not match the argument type");
+                                break;
+                        case 's':
+                                if(STRING != arg.kind || '\0' != length[0])
+                                        format_error("%s expects a narrow C string argument");
+                                break;
+                        case 'p':
+                                if((POINTER != arg.kind && STRING != arg.kind) || '\0' != length[0])
+                                        format_error("%p expects a pointer argument");
+                                break;
+                        default:
+                                format_error("unsupported conversion specifier");
+                        }
+                }
+
+                static std::string_view literal(char const * str, Literal const& lit)
+                {
+                        return std::string_view(str + lit.begin, lit.size);
+                }
+
+                void append_literal(std::string& out, Literal const& lit) const
+                {
+                        std::string_view text = literal(m_str, lit);
+                        if(false == lit.escaped)
+                        {
+                                out += text;
+                                return;
+                        }
+                        for(std::size_t i = 0; i < text.size(); ++i)
+                        {
+                                out += text[i];
+                                if('%' == text[i])
+                                        ++i;
+                        }
+                }
+
+                template<class T>
+                static auto promote(T const& arg)
+                {
+                        if constexpr (std::is_enum_v<T>)
+                                return +static_cast<std::underlying_type_t<T>>(arg);
+                        else
+                                return +arg;
+                }
+
+                template<class T>
+                static void append_arg(std::string& out, Conversion const& conv, T const& arg)
+                {
+                        if(true == conv.simple)
+                        {
+                                char buf[64];
+                                std::to_chars_result res{ nullptr, std::errc() };
+                                if constexpr (is_cstring_v<T>)
+                                {
+                                        if('s' == conv.conversion)
+                                        {
+                                                out += nullptr == arg ? "(null)" : arg;
+                                                return;
+                                        }
+                                }
+                                else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>)
+                                {
+                                        auto value = promote(arg);
+                                        auto uvalue = static_cast<std::make_unsigned_t<decltype(value)>>(value);
+                                        switch(conv.conversion)
+                                        {
+                                        case 'd': case 'i':
+                                                res = std::to_chars(buf, buf + sizeof(buf), value);
+                                                break;
+                                        case 'u':
+                                                res = std::to_chars(buf, buf + sizeof(buf), uvalue);
+                                                break;
+                                        case 'x':
+                                                res = std::to_chars(buf, buf + sizeof(buf), uvalue, 16);
+                                                break;
+                                        case 'o':
+                                                res = std::to_chars(buf, buf + sizeof(buf), uvalue, 8);
+                                                break;
+                                        case 'c':
+                                                out += static_cast<char>(value);
+                                                return;
+                                        }
+                                }
+                                else if constexpr (std::is_floating_point_v<T> && false == std::is_same_v<T, long double>)
+                                {
+                                        int precision = conv.precision < 0 ? 6 : conv.precision;
+                                        double value = arg;
+                                        switch(conv.conversion)
+                                        {
+                                        case 'f':
+                                                res = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed, precision);
+                                                break;
+                                        case 'e':
+                                                res = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::scientific, precision);
+                                                break;
+                                        case 'g':
+                                                res = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::general, precision);
+                                                break;
+                                        }
+                                }
+                                if(nullptr != res.ptr && std::errc() == res.ec)
+                                {
+                                        out.append(buf, res.ptr);
+                                        return;
+                                }
+                        }
+
+                        char buf[64];
+                        int size = std::snprintf(buf, sizeof(buf), conv.spec, arg);
+                        if(size < 0)
+                                throw std::runtime_error("Error during formatting.");
+                        if(static_cast<std::size_t>(size) < sizeof(buf))
+                        {
+                                out.append(buf, size);
+                                return;
+                        }
+                        std::size_t pos = out.size();
+                        out.resize(pos + size + 1);
+                        std::snprintf(out.data() + pos, size + 1, conv.spec, arg);
+                        out.resize(pos + size);
+                }
+
+                template<std::size_t ...I>
+                void append_all(std::string& out, std::index_sequence<I...>, A const& ... args) const
+                {
+                        ((append_literal(out, m_literals[I]), append_arg(out, m_conversions[I], args)), ...);
+                        append_literal(out, m_literals[sizeof...(A)]);
+                }
+
+        public:
+                template<class S>
+                        requires std::is_convertible_v<S const&, char const *>
+                consteval format_string(S const& str)
+                        : m_str(str)
+                        , m_literals{}
+                        , m_conversions{}
+                {
+                        constexpr ArgInfo args[sizeof...(A) + 1] = { arg_info<A>()..., { UNSUPPORTED, 0 } };
+                        std::size_t count = 0;
+                        std::size_t begin = 0;
+                        bool escaped = false;
+                        std::size_t i = 0;
+                        for(; '\0' != m_str[i]; ++i)
+                        {
+                                if('%' != m_str[i])
+                                        continue;
+                                if('%' == m_str[i + 1])
+                                {
+                                        escaped = true;
+                                        ++i;
+                                        continue;
+                                }
+                                if(sizeof...(A) == count)
+                                        format_error("more conversions than arguments");
+
+                                Conversion& conv = m_conversions[count];
+                                conv.precision = -1;
+                                conv.simple = true;
+                                std::size_t j = i + 1;
+                                while('-' == m_str[j] || '+' == m_str[j] || ' ' == m_str[j] || '#' == m_str[j] || '0' == m_str[j])
+                                        conv.simple = false, ++j;
+                                while('0' <= m_str[j] && '9' >= m_str[j])
+                                        conv.simple = false, ++j;
+                                if('.' == m_str[j])
+                                {
+                                        conv.precision = 0;
+                                        for(++j; '0' <= m_str[j] && '9' >= m_str[j]; ++j)
+                                                conv.precision = conv.precision * 10 + (m_str[j] - '0');
+                                }
+                                if('*' == m_str[j] || '*' == m_str[j - 1])
+                                        format_error("'*' width and precision are not supported");
+
+                                char length[3] = {};
+                                std::size_t length_size = 0;
+                                while(length_size < 2 && ('h' == m_str[j] || 'l' == m_str[j] || 'L' == m_str[j] || 'z' == m_str[j] || 'j' == m_str[j] || 't' == m_str[j]))
+                                        length[length_size++] = m_str[j++];
+
+                                conv.conversion = m_str[j];
+                                check(conv.conversion, length, args[count]);
+                                if(j + 1 - i >= sizeof(conv.spec))
+                                        format_error("conversion specification is too long");
+                                for(std::size_t k = i; k <= j; ++k)
+                                        conv.spec[k - i] = m_str[k];
+                                if(conv.precision >= 0 && 'f' != conv.conversion && 'e' != conv.conversion && 'g' != conv.conversion)
+                                        conv.simple = false;
+
+                                m_literals[count++] = { begin, i - begin, escaped };
+                                escaped = false;
+                                begin = j + 1;
+                                i = j;
+                        }
+                        if(sizeof...(A) != count)
+                                format_error("fewer conversions than arguments");
+                        m_literals[count] = { begin, i - begin, escaped };
+                }
+
+                char const * get(void) const
+                {
+                        return m_str;
+                }
+
+                std::string_view format_to(std::string& out, A const& ... args) const
+                {
+                        out.clear();
+                        this->append_all(out, std::index_sequence_for<A...>{}, args...);
+                        return out;
+                }
+        };
+
+        template<typename ...T>
+	static void logf(Logger::severity_t severity, const char * FILE, size_t LINE, format_string<std::decay_t<T>...> fmt, T&& ... args)
+	{
+	        get_default().emit(severity, FILE, LINE, fmt, std::forward<T>(args)...);
+	}
+
+        template<typename ...T>
+	void emit(Logger::severity_t severity, const char * FILE, size_t LINE, format_string<std::decay_t<T>...> fmt, T&& ... args)
+	{
+	        if(false == is_enabled(severity) && false == is_flight_recording())
+        	        return;
+
+	        this->logf_internal(severity, FILE, LINE, fmt, std::forward<T>(args)...);
+	}
+
+        // Structured record: an event name and typed key/value fields, e.g.
+        // log(INFO, __FILE__, __LINE__, "task_done", kv("task_id", id)). Fields
+        // are encoded straight into the per-thread staging record, without heap
+        // allocation; fields that no longer fit in record_capacity are dropped.
+        template<typename ...T>
+	static void log(Logger::severity_t severity, const char * FILE, size_t LINE, char const * event, Field<T> const& ... fields)
+	{
+	        get_default().emit_kv(severity, FILE, LINE, event, fields...);
+	}
+
+        template<typename ...T>
+	void emit_kv(Logger::severity_t severity, const char * FILE, size_t LINE, char const * event, Field<T> const& ... fields)
+	{
+	        if(false == is_enabled(severity) && false == is_flight_recording())
+        	        return;
+
+                std::size_t count = sink_count.load(std::memory_order_acquire);
+                std::uint32_t route = this->route(severity, count);
+                bool recording = flight_recording.load(std::memory_order_relaxed);
+                if(0 == route && false == recording)
+                        return;
+
+                Record& record = staging_record(severity, FILE, LINE);
+                record.fmt = nullptr;
+                record.event = event;
+                record.decoder = nullptr;
+                record.formatter = nullptr;
+                char * dst = record.data;
+                bool fits = true;
+                ((fits = fits && encode_field(dst, record.data + record_capacity, fields)), ...);
+                record.size = dst - record.data;
+                if(true == recording)
+                        flight_record(record);
+                this->publish(record, count, route);
+	}
+
+        // Calls f(FieldView const&) for every field of a structured entry. Every
+        // length is checked against the entry, and decoding stops at the first
+        // field that would run past its end.
+        template<class F>
+        static void for_each_field(std::string_view fields, F&& f)
+        {
+                char const * src = fields.data();
+                char const * end = src + fields.size();
+                auto left = [&src, end](void) { return static_cast<std::size_t>(end - src); };
+                while(2 <= left())
+                {
+                        FieldView field{};
+                        field.type = static_cast<field_type_t>(*src++);
+                        std::size_t key_len = static_cast<std::uint8_t>(*src++);
+                        if(key_len > left())
+                                return;
+                        field.key = std::string_view(src, key_len);
+                        src += key_len;
+                        switch(field.type)
+                        {
+                        case FIELD_INT:
+                                if(sizeof(field.int_value) > left())
+                                        return;
+                                std::memcpy(&field.int_value, src, sizeof(field.int_value));
+                                src += sizeof(field.int_value);
+                                break;
+                        case FIELD_UINT:
+                                if(sizeof(field.uint_value) > left())
+                                        return;
+                                std::memcpy(&field.uint_value, src, sizeof(field.uint_value));
+                                src += sizeof(field.uint_value);
+                                break;
+                        case FIELD_DOUBLE:
+                                if(sizeof(field.double_value) > left())
+                                        return;
+                                std::memcpy(&field.double_value, src, sizeof(field.double_value));
+                                src += sizeof(field.double_value);
+                                break;
+                        case FIELD_BOOL:
+                                if(0 == left())
+                                        return;
+                                field.bool_value = 0 != *src++;
+                                break;
+                        case FIELD_STRING:
+                        {
+                                std::uint16_t len;
+                                if(sizeof(len) > left())
+                                        return;
+                                std::memcpy(&len, src, sizeof(len));
+                                src += sizeof(len);
+                                if(len > left())
+                                        return;
+                                field.string_value = std::string_view(src, len);
+                                src += len;
+                                break;
+                        }
+                        default:
+                                return;
+                        }
+                        f(field);
+                }
+        }
+
+        static Logger& get_default(void)
+        {
+        	if(nullptr == this_ptr)
+                	throw std::runtime_error("The logger must first be instantiated");
+                return *this_ptr;
+        }
+
+        void make_default(void)
+        {
+                this_ptr = this;
+        }
+
+        // Sinks are started when added and cannot be removed; the routing of a
+        // record is decided once, against every sink's severity filter.
+        template<class S>
+        S& add_sink(std::unique_ptr<S> sink)
+        {
+                std::lock_guard<std::mutex> lg(sinks_mutex);
+                std::size_t count = sink_count.load(std::memory_order_relaxed);
+                if(max_sinks == count)
+                        throw std::runtime_error("Too many sinks");
+                S& res = *sink;
+                sink->start();
+                sinks[count] = std::move(sink);
+                sink_count.store(count + 1, std::memory_order_release);
+                return res;
+        }
+
+        void set_deferred(bool deferred_param)
+        {
+                deferred.store(deferred_param, std::memory_order_relaxed);
+        }
+
+        // The threshold belongs to the logger; each one filters its own records.
+        bool is_enabled(Logger::severity_t severity) const
+        {
+                return severity >= min_severity.load(std::memory_order_relaxed);
+        }
+
+        // Records failing is_enabled() are still emitted for the flight recorder
+        // while it is on, but never reach a sink.
+        static bool is_flight_recording(void)
+        {
+                return flight_recording.load(std::memory_order_relaxed);
+        }
+
+        void set_min_severity(Logger::severity_t severity)
+        {
+                min_severity.store(severity, std::memory_order_relaxed);
+        }
+
+        Logger::severity_t get_min_severity(void) const
+        {
+                return min_severity.load(std::memory_order_relaxed);
+        }
+
+        // Makes signo swap the threshold of the default logger between its
+        // current value and DEBUG, e.g. to turn debug output on and off with
+        // SIGUSR1.
+        static void install_severity_toggle(int signo = SIGUSR1)
+        {
+                struct sigaction action{};
+                action.sa_handler = &Logger::toggle_severity;
+                sigemptyset(&action.sa_mask);
+                action.sa_flags = SA_RESTART;
+                if(0 > sigaction(signo, &action, nullptr))
+                        throw std::runtime_error(strerror(errno));
+        }
+
+        // Keeps the last records_per_thread records of every thread in memory,
+        // whatever the severity threshold, for dump_flight_recorder(). Records
+        // below LOGGER_MIN_SEVERITY are not seen, nor those passing the threshold
+        // but rejected by the sampling or rate limit of their call site.
+        // Records below the threshold are kept with their raw arguments and
+        // only formatted when dumped. Messages longer than flight_text_capacity
+        // are truncated.
+        static void enable_flight_recorder(std::size_t records_per_thread = 256)
+        {
+                flight_capacity.store(0 == records_per_thread ? 1 : records_per_thread, std::memory_order_relaxed);
+                flight_recording.store(true, std::memory_order_relaxed);
+        }
+
+        static void disable_flight_recorder(void)
+        {
+                flight_recording.store(false, std::memory_order_relaxed);
+        }
+
+        // Writes the recorded records to fd, oldest first within each thread.
+        // Only uses async-signal-safe calls: records kept raw are formatted by
+        // format_signal_safe(). Slots being rewritten meanwhile are skipped.
+        static void dump_flight_recorder(int fd)
+        {
+                for(FlightBuffer * buffer = flight_buffers.load(std::memory_order_acquire); nullptr != buffer; buffer = buffer->next)
+                {
+                        std::uint64_t head = buffer->head.load(std::memory_order_acquire);
+                        for(std::uint64_t i = head > buffer->capacity ? head - buffer->capacity : 0; i < head; ++i)
+                                dump_flight_slot(fd, buffer->slots[i % buffer->capacity]);
+                }
         }
 
-	Logger(const Logger&) = delete;
-
-        Logger& operator=(const Logger&) = delete;
+        // Dumps the flight recorder to path (the standard error for a null path)
+        // when one of signals is delivered, then lets the signal take its default
+        // action. SIGABRT covers std::terminate().
+        static void install_crash_handler(char const * path, std::initializer_list<int> signals = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT })
+        {
+                if(nullptr == path)
+                        crash_dump_path[0] = '\0';
+                else if(std::strlen(path) >= sizeof(crash_dump_path))
+                        throw std::runtime_error("Crash dump path is too long");
+                else
+                        std::strcpy(crash_dump_path, path);
 
-        Logger(Logger&&) = delete;
+                struct sigaction action{};
+                action.sa_handler = &Logger::crash_handler;
+                sigemptyset(&action.sa_mask);
+                action.sa_flags = SA_RESETHAND;
+                for(int signo : signals)
+                        if(0 > sigaction(signo, &action, nullptr))
+                                throw std::runtime_error(strerror(errno));
+        }
 
-        Logger& operator=(Logger&&) = delete;
+        // Admits at most per_second records per second, with bursts of up to burst
+        // records, from the LOGF() sites in the given file (matched as a path
+        // suffix) and line; line 0 covers the whole file. A zero rate removes the
+        // limit.
+        static void set_rate_limit(char const * file, std::size_t line, double per_second, std::size_t burst = 1)
+        {
+                std::lock_guard<std::mutex> lg(sites_mutex);
+                SiteRule& rule = find_rule(file, line);
+                rule.per_second = per_second;
+                rule.burst = 0 == burst ? 1 : burst;
+                apply_rule(rule);
+        }
 
+        // Admits one record out of every_nth from the matching LOGF() sites;
+        // every_nth <= 1 removes the sampling.
+        static void set_sampling(char const * file, std::size_t line, std::uint32_t every_nth)
+        {
+                std::lock_guard<std::mutex> lg(sites_mutex);
+                SiteRule& rule = find_rule(file, line);
+                rule.sample_every = every_nth;
+                apply_rule(rule);
+        }
 
-	//TODO: Add static check for correct formatting
-        template<typename ...T>
-	static void logf(Logger::severity_t severity, const char * FILE, size_t LINE, char const* fmt, T&& ... args)  //__attribute__ ((format(printf, 4, 5)));
-	{
-        	if(nullptr == this_ptr)
-                	throw std::runtime_error("The logger must first be instantiated");
 
-	        if(Logger::DEBUG == severity && false == this_ptr->debug)
-        	        return;
+        // Sub-second precision switches timestamps from the coarse clock to the
+        // precise (still vDSO-backed) realtime clock, for every logger.
+        static void set_timestamp_precision(timestamp_precision_t precision)
+        {
+                timestamp_precision.store(precision, std::memory_order_relaxed);
+        }
 
-	        this_ptr->logf_internal(severity, FILE, LINE, fmt, std::forward<T>(args)...);
-	}
+        // Records dropped on overflow by the sinks of the default logger.
+        static std::uint64_t dropped_count(void)
+        {
+                Logger& logger = get_default();
+                std::uint64_t res = 0;
+                for(std::size_t i = 0; i < logger.sink_count.load(std::memory_order_acquire); ++i)
+                        res += logger.sinks[i]->dropped_count();
+                return res;
+        }
 
 
 
 private:
 
-        char const * get_severity_str(Logger::severity_t severity) const
+        static char const * get_severity_str(Logger::severity_t severity)
         {
                 switch(severity)
                 {
@@ -94,7 +1638,7 @@ private:
                 return nullptr;
         }
 
-	char const * get_severity_color_str(Logger::severity_t severity) const
+	static char const * get_severity_color_str(Logger::severity_t severity)
 	{
 		switch(severity)
                 {
@@ -109,19 +1653,885 @@ private:
                 }
 	}
 
-	template<typename ...T>
-        void logf_internal(Logger::severity_t severity, const char * FILE, size_t LINE, char const * fmt, T&& ... args)
+        static timespec now(void)
+        {
+                timespec res;
+                clock_gettime(SECONDS == timestamp_precision.load(std::memory_order_relaxed) ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &res);
+                return res;
+        }
+
+        // Each thread keeps the last rendered second, so localtime_r and strftime
+        // only run when the second changes.
+        static char const * date_str(std::time_t second)
+        {
+                thread_local std::time_t cached_second = -1;
+                thread_local char cached[16];
+                if(cached_second != second)
+                {
+                        std::tm local;
+                        localtime_r(&second, &local);
+                        std::strftime(cached, sizeof(cached), "%Y%m%d%H%M%S", &local);
+                        cached_second = second;
+                }
+                return cached;
+        }
+
+        static std::string thread_id_str(std::thread::id thread_id)
         {
-                std::time_t cur_time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-                std::tm * cur_time_local = std::localtime(&cur_time);
+                std::ostringstream os;
+                os << thread_id;
+                return os.str();
+        }
+
+        static std::string const& this_thread_id_str(void)
+        {
+                thread_local std::string const cached = thread_id_str(std::this_thread::get_id());
+                return cached;
+        }
+
+        static void render_text(Entry const& entry, bool colored, bool show_source, std::string_view thread_id, std::string& line)
+        {
+                if(true == colored)
+                        line += get_severity_color_str(entry.severity);
+                line += date_str(entry.time.tv_sec);
+
+                timestamp_precision_t precision = timestamp_precision.load(std::memory_order_relaxed);
+                if(SECONDS != precision)
+                {
+                        int digits = MILLISECONDS == precision ? 3 : 6;
+                        long fraction = MILLISECONDS == precision ? entry.time.tv_nsec / 1000000 : entry.time.tv_nsec / 1000;
+                        char buf[8] = { '.', '0', '0', '0', '0', '0', '0' };
+                        for(int i = digits; i > 0; --i, fraction /= 10)
+                                buf[i] = '0' + fraction % 10;
+                        line.append(buf, digits + 1);
+                }
+
+                line += " [";
+                line += thread_id;
+                line += "] ";
+                line += get_severity_str(entry.severity);
+                line += ": ";
+                if(nullptr == entry.event)
+                        line += entry.message;
+                else
+                        append_fields_text(line, entry.event, entry.fields);
                 if(true == show_source)
-                        std::osyncstream(out) << get_severity_color_str(severity) << std::put_time(cur_time_local, "%Y%m%d%H%M%S") << " [" << std::this_thread::get_id() << "] " << get_severity_str(severity) << ": " << this->format(fmt, std::forward<T>(args)...) << " (FROM: " << FILE << ":" << LINE << ")" << get_severity_color_str(Logger::severity_t::INFO) << std::endl;
+                {
+                        char buf[24];
+                        line += " (FROM: ";
+                        line += entry.file;
+                        line += ':';
+                        line.append(buf, std::to_chars(buf, buf + sizeof(buf), entry.line).ptr);
+                        line += ')';
+                }
+                if(true == colored)
+                        line += get_severity_color_str(Logger::severity_t::INFO);
+                line += '\n';
+        }
+
+        static void append_json_string(std::string& out, std::string_view str)
+        {
+                out += '"';
+                for(char c : str)
+                {
+                        switch(c)
+                        {
+                        case '"':
+                                out += "\\\"";
+                                break;
+                        case '\\':
+                                out += "\\\\";
+                                break;
+                        case '\n':
+                                out += "\\n";
+                                break;
+                        case '\r':
+                                out += "\\r";
+                                break;
+                        case '\t':
+                                out += "\\t";
+                                break;
+                        default:
+                                if(static_cast<unsigned char>(c) < 0x20)
+                                {
+                                        char buf[8];
+                                        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                                        out += buf;
+                                }
+                                else
+                                        out += c;
+                        }
+                }
+                out += '"';
+        }
+
+        static void toggle_severity(int)
+        {
+                Logger* logger = this_ptr;
+                if(nullptr == logger)
+                        return;
+                severity_t cur = logger->min_severity.load(std::memory_order_relaxed);
+                logger->min_severity.store(logger->toggled_severity.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                logger->toggled_severity.store(cur, std::memory_order_relaxed);
+        }
+
+        static bool rule_matches(SiteRule const& rule, CallSite const& site)
+        {
+                std::string_view file(site.m_file);
+                if(0 != rule.line && rule.line != site.m_line)
+                        return false;
+                if(file.size() < rule.file.size() || 0 != file.compare(file.size() - rule.file.size(), rule.file.size(), rule.file))
+                        return false;
+                return file.size() == rule.file.size() || '/' == file[file.size() - rule.file.size() - 1];
+        }
+
+        static SiteRule& find_rule(char const * file, std::size_t line)
+        {
+                for(auto& rule : site_rules)
+                        if(rule.file == file && rule.line == line)
+                                return rule;
+                return site_rules.emplace_back(SiteRule{ file, line, 0, 1, 0 });
+        }
+
+        static void configure_site(CallSite& site, SiteRule const& rule)
+        {
+                std::uint32_t mode = 0;
+                if(rule.per_second > 0)
+                {
+                        std::uint64_t interval = static_cast<std::uint64_t>(1e9 / rule.per_second);
+                        site.m_interval_ns.store(interval, std::memory_order_relaxed);
+                        site.m_tolerance_ns.store(interval * (rule.burst - 1), std::memory_order_relaxed);
+                        mode |= CallSite::RATE_LIMITED;
+                }
+                if(rule.sample_every > 1)
+                {
+                        site.m_sample_every.store(rule.sample_every, std::memory_order_relaxed);
+                        mode |= CallSite::SAMPLED;
+                }
+                site.m_mode.store(mode, std::memory_order_relaxed);
+        }
+
+        static void apply_rule(SiteRule const& rule)
+        {
+                for(CallSite* site = sites; nullptr != site; site = site->m_next)
+                        if(true == rule_matches(rule, *site))
+                                configure_site(*site, rule);
+        }
+
+        static std::uint64_t monotonic_ns(void)
+        {
+                timespec res;
+                clock_gettime(CLOCK_MONOTONIC_COARSE, &res);
+                return static_cast<std::uint64_t>(res.tv_sec) * 1000000000 + res.tv_nsec;
+        }
+
+        void report_suppressed(CallSite& site)
+        {
+                std::uint64_t suppressed = site.m_suppressed.exchange(0, std::memory_order_relaxed);
+                if(0 != suppressed)
+                        this->logf_internal(WARNING, site.m_file, site.m_line, format_string<unsigned long long>("%llu similar message(s) suppressed"), static_cast<unsigned long long>(suppressed));
+        }
+
+        void report_suppressed(void)
+        {
+                std::lock_guard<std::mutex> lg(sites_mutex);
+                for(CallSite* site = sites; nullptr != site; site = site->m_next)
+                        report_suppressed(*site);
+        }
+
+	template<typename ...T>
+        void logf_internal(Logger::severity_t severity, const char * FILE, size_t LINE, format_string<std::decay_t<T>...> const& fmt, T&& ... args)
+        {
+                std::size_t count = sink_count.load(std::memory_order_acquire);
+                std::uint32_t route = this->route(severity, count);
+                bool recording = flight_recording.load(std::memory_order_relaxed);
+                if(0 == route && false == recording)
+                        return;
+
+                // Records only kept by the flight recorder are captured raw, and only
+                // formatted if they are ever dumped.
+                Record& record = staging_record(severity, FILE, LINE);
+                record.fmt = fmt.get();
+                record.event = nullptr;
+                if((0 != route && false == deferred.load(std::memory_order_relaxed)) || false == capture_deferred(record, args...))
+                {
+                        std::string_view message = fmt.format_to(staging_message(), args...);
+                        record.decoder = nullptr;
+                        record.formatter = nullptr;
+                        record.size = std::min(message.size(), record_capacity);
+                        std::memcpy(record.data, message.data(), record.size);
+                        if(message.size() > record_capacity && 0 != route)
+                                record.overflow = std::make_shared<std::string const>(message);
+                }
+                if(true == recording)
+                        flight_record(record);
+                this->publish(record, count, route);
+        }
+
+        // Sinks accepting severity; none while it is below the threshold, for
+        // records only emitted for the flight recorder.
+        std::uint32_t route(severity_t severity, std::size_t count) const
+        {
+                if(severity < min_severity.load(std::memory_order_relaxed))
+                        return 0;
+                std::uint32_t res = 0;
+                for(std::size_t i = 0; i < count; ++i)
+                        if(true == sinks[i]->accepts(severity))
+                                res |= 1u << i;
+                return res;
+        }
+
+        void publish(Record const& record, std::size_t count, std::uint32_t route)
+        {
+                for(std::size_t i = 0; i < count; ++i)
+                        if(0 != (route & (1u << i)))
+                                sinks[i]->push(record);
+        }
+
+        // Per-thread buffers shared by every logging call of the thread.
+        static Record& staging_record(severity_t severity, char const * file, std::size_t line)
+        {
+                thread_local Record record;
+                record.overflow.reset();
+                record.severity = severity;
+                record.file = file;
+                record.line = line;
+                record.time = now();
+                record.thread_id = std::this_thread::get_id();
+                return record;
+        }
+
+        static std::string& staging_message(void)
+        {
+                thread_local std::string message;
+                return message;
+        }
+
+        static FlightBuffer * this_flight_buffer(void)
+        {
+                thread_local FlightHandle handle;
+                if(nullptr != handle.buffer)
+                        return handle.buffer;
+
+                for(FlightBuffer * buffer = flight_buffers.load(std::memory_order_acquire); nullptr != buffer; buffer = buffer->next)
+                {
+                        bool expected = false;
+                        if(false == buffer->in_use.load(std::memory_order_relaxed) && true == buffer->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                                return handle.buffer = buffer;
+                }
+
+                FlightBuffer * buffer = new FlightBuffer(flight_capacity.load(std::memory_order_relaxed));
+                buffer->next = flight_buffers.load(std::memory_order_relaxed);
+                while(false == flight_buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release, std::memory_order_relaxed))
+                        ;
+                return handle.buffer = buffer;
+        }
+
+        // Copies the raw arguments or fields when they fit in the slot; otherwise
+        // formats straight into it, truncated, without allocating.
+        static void flight_record(Record const& record)
+        {
+                FlightBuffer * buffer = this_flight_buffer();
+                std::uint64_t head = buffer->head.load(std::memory_order_relaxed);
+                FlightSlot& slot = buffer->slots[head % buffer->capacity];
+                std::uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+                slot.seq.store(seq + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                slot.time = record.time;
+                slot.thread_id = static_cast<unsigned long>(pthread_self());
+                slot.file = record.file;
+                slot.line = record.line;
+                slot.severity = record.severity;
+                slot.fmt = nullptr;
+                slot.event = nullptr;
+                slot.formatter = nullptr;
+                bool const raw = nullptr != record.event || nullptr != record.formatter;
+                if(true == raw && record.size <= flight_text_capacity)
+                {
+                        slot.fmt = record.fmt;
+                        slot.event = record.event;
+                        slot.formatter = record.formatter;
+                        slot.size = record.size;
+                        std::memcpy(slot.data, record.data, slot.size);
+                }
+                else if(nullptr != record.event)
+                        slot.size = render_fields(record.event, std::string_view(record.data, record.size), slot.data, flight_text_capacity);
+                else if(nullptr != record.formatter)
+                        slot.size = record.formatter(record.fmt, record.data, slot.data, flight_text_capacity);
+                else
+                {
+                        slot.size = std::min(record.size, flight_text_capacity);
+                        std::memcpy(slot.data, record.data, slot.size);
+                }
+                slot.seq.store(seq + 2, std::memory_order_release);
+                buffer->head.store(head + 1, std::memory_order_release);
+        }
+
+        static void write_all(int fd, char const * data, std::size_t size)
+        {
+                while(0 != size)
+                {
+                        ssize_t res = ::write(fd, data, size);
+                        if(0 > res && EINTR == errno)
+                                continue;
+                        if(0 >= res)
+                                return;
+                        data += res;
+                        size -= res;
+                }
+        }
+
+        // Text of a structured record, rendered like append_fields_text() but
+        // into a fixed buffer, unquoted, and without allocating.
+        static std::size_t render_fields(char const * event, std::string_view fields, char * out, std::size_t capacity)
+        {
+                char * cur = out;
+                char * end = out + capacity;
+                auto append = [&cur, end](std::string_view str)
+                {
+                        std::size_t len = std::min<std::size_t>(str.size(), end - cur);
+                        std::memcpy(cur, str.data(), len);
+                        cur += len;
+                };
+
+                append(event);
+                for_each_field(fields, [&cur, end, &append](FieldView const& field)
+                {
+                        append(" ");
+                        append(field.key);
+                        append("=");
+                        switch(field.type)
+                        {
+                        case FIELD_INT:
+                                cur = std::to_chars(cur, end, field.int_value).ptr;
+                                break;
+                        case FIELD_UINT:
+                                cur = std::to_chars(cur, end, field.uint_value).ptr;
+                                break;
+                        case FIELD_DOUBLE:
+                                cur = std::to_chars(cur, end, field.double_value).ptr;
+                                break;
+                        case FIELD_BOOL:
+                                append(field.bool_value ? "true" : "false");
+                                break;
+                        case FIELD_STRING:
+                                append(field.string_value);
+                                break;
+                        }
+                });
+                return cur - out;
+        }
+
+        // printf() for the conversions format_string admits, built on
+        // to_chars() alone so that the crash handler can decode raw records: it
+        // neither locks, allocates nor reads the locale. The '#' flag is ignored
+        // on floating point conversions. The output is truncated to capacity.
+        static std::size_t format_signal_safe(char const * fmt, RawArg const * args, std::size_t count, char * out, std::size_t capacity)
+        {
+                char * cur = out;
+                char * const end = out + capacity;
+                auto append = [&cur, end](char const * str, std::size_t len)
+                {
+                        len = std::min<std::size_t>(len, end - cur);
+                        std::memcpy(cur, str, len);
+                        cur += len;
+                };
+                auto pad = [&cur, end](char c, std::size_t len)
+                {
+                        len = std::min<std::size_t>(len, end - cur);
+                        std::memset(cur, c, len);
+                        cur += len;
+                };
+
+                std::size_t next = 0;
+                while('\0' != *fmt)
+                {
+                        if('%' == fmt[0] && '%' == fmt[1])
+                        {
+                                append(fmt, 1);
+                                fmt += 2;
+                                continue;
+                        }
+                        if('%' != *fmt)
+                        {
+                                char const * literal = fmt;
+                                while('\0' != *fmt && '%' != *fmt)
+                                        ++fmt;
+                                append(literal, fmt - literal);
+                                continue;
+                        }
+
+                        bool left = false, plus = false, space = false, alt = false, zero = false;
+                        for(++fmt; ; ++fmt)
+                        {
+                                if('-' == *fmt)
+                                        left = true;
+                                else if('+' == *fmt)
+                                        plus = true;
+                                else if(' ' == *fmt)
+                                        space = true;
+                                else if('#' == *fmt)
+                                        alt = true;
+                                else if('0' == *fmt)
+                                        zero = true;
+                                else
+                                        break;
+                        }
+                        std::size_t width = 0;
+                        for(; '0' <= *fmt && '9' >= *fmt; ++fmt)
+                                width = width * 10 + (*fmt - '0');
+                        int precision = -1;
+                        if('.' == *fmt)
+                                for(precision = 0, ++fmt; '0' <= *fmt && '9' >= *fmt; ++fmt)
+                                        precision = precision * 10 + (*fmt - '0');
+                        // Only h and hh narrow the argument; the others match its size.
+                        std::size_t narrow = 0;
+                        for(; 'h' == *fmt || 'l' == *fmt || 'L' == *fmt || 'z' == *fmt || 'j' == *fmt || 't' == *fmt; ++fmt)
+                                if('h' == *fmt)
+                                        narrow = 0 == narrow ? sizeof(short) : sizeof(char);
+                        char const conversion = *fmt;
+                        if('\0' == conversion || count == next)
+                                break;
+                        ++fmt;
+                        RawArg const& arg = args[next++];
+
+                        char prefix[3];
+                        std::size_t prefix_size = 0;
+                        char body[512];
+                        char const * text = body;
+                        std::size_t size = 0;
+                        std::size_t zeros = 0;
+                        bool numeric = true;
+                        bool floating = false;
+                        switch(conversion)
+                        {
+                        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+                        {
+                                std::size_t bytes = 0 != narrow ? narrow : arg.size;
+                                unsigned long long mask = bytes >= sizeof(mask) ? ~0ull : (1ull << bytes * 8) - 1;
+                                unsigned long long value = arg.bits & mask;
+                                if(('d' == conversion || 'i' == conversion) && 0 != (value >> (bytes * 8 - 1)))
+                                {
+                                        prefix[prefix_size++] = '-';
+                                        value = ((~value) & mask) + 1;
+                                }
+                                else if('d' == conversion || 'i' == conversion)
+                                {
+                                        if(true == plus || true == space)
+                                                prefix[prefix_size++] = true == plus ? '+' : ' ';
+                                }
+                                else if(true == alt && 0 != value && ('x' == conversion || 'X' == conversion))
+                                {
+                                        prefix[prefix_size++] = '0';
+                                        prefix[prefix_size++] = conversion;
+                                }
+                                int base = 'o' == conversion ? 8 : ('x' == conversion || 'X' == conversion) ? 16 : 10;
+                                if(0 != precision || 0 != value)
+                                        size = std::to_chars(body, body + sizeof(body), value, base).ptr - body;
+                                if('X' == conversion)
+                                        for(std::size_t i = 0; i < size; ++i)
+                                                body[i] = 'a' <= body[i] && 'f' >= body[i] ? body[i] - 0x20 : body[i];
+                                if(0 <= precision && static_cast<std::size_t>(precision) > size)
+                                        zeros = precision - size;
+                                if(true == alt && 'o' == conversion && 0 == zeros && (0 == size || '0' != body[0]))
+                                        zeros = 1;
+                                break;
+                        }
+                        case 'c':
+                                body[0] = static_cast<char>(arg.bits);
+                                size = 1;
+                                numeric = false;
+                                break;
+                        case 's':
+                                text = nullptr == arg.string_value ? "(null)" : arg.string_value;
+                                size = std::strlen(text);
+                                if(0 <= precision)
+                                        size = std::min<std::size_t>(size, precision);
+                                numeric = false;
+                                break;
+                        case 'p':
+                                if(0 == arg.bits)
+                                {
+                                        text = "(nil)";
+                                        size = 5;
+                                        numeric = false;
+                                        break;
+                                }
+                                prefix[prefix_size++] = '0';
+                                prefix[prefix_size++] = 'x';
+                                size = std::to_chars(body, body + sizeof(body), arg.bits, 16).ptr - body;
+                                break;
+                        default:
+                        {
+                                char const lower = conversion | 0x20;
+                                std::chars_format const format = 'f' == lower ? std::chars_format::fixed : 'e' == lower ? std::chars_format::scientific : 'g' == lower ? std::chars_format::general : std::chars_format::hex;
+                                bool const negative = RawArg::LONG_DOUBLE == arg.kind ? std::signbit(arg.long_double_value) : std::signbit(arg.double_value);
+                                bool const finite = RawArg::LONG_DOUBLE == arg.kind ? std::isfinite(arg.long_double_value) : std::isfinite(arg.double_value);
+                                if(true == negative)
+                                        prefix[prefix_size++] = '-';
+                                else if(true == plus || true == space)
+                                        prefix[prefix_size++] = true == plus ? '+' : ' ';
+                                if('a' == lower && true == finite)
+                                {
+                                        prefix[prefix_size++] = '0';
+                                        prefix[prefix_size++] = 'x';
+                                }
+                                std::to_chars_result res;
+                                if(RawArg::LONG_DOUBLE == arg.kind)
+                                {
+                                        long double value = true == negative ? -arg.long_double_value : arg.long_double_value;
+                                        res = 'a' == lower && 0 > precision ? std::to_chars(body, body + sizeof(body), value, format) : std::to_chars(body, body + sizeof(body), value, format, 0 > precision ? 6 : precision);
+                                }
+                                else
+                                {
+                                        double value = true == negative ? -arg.double_value : arg.double_value;
+                                        res = 'a' == lower && 0 > precision ? std::to_chars(body, body + sizeof(body), value, format) : std::to_chars(body, body + sizeof(body), value, format, 0 > precision ? 6 : precision);
+                                }
+                                size = std::errc() == res.ec ? res.ptr - body : 0;
+                                if(conversion != lower)
+                                {
+                                        for(std::size_t i = 0; i < prefix_size; ++i)
+                                                prefix[i] = 'x' == prefix[i] ? 'X' : prefix[i];
+                                        for(std::size_t i = 0; i < size; ++i)
+                                                body[i] = 'a' <= body[i] && 'z' >= body[i] ? body[i] - 0x20 : body[i];
+                                }
+                                numeric = finite;
+                                floating = true;
+                                break;
+                        }
+                        }
+
+                        std::size_t const total = prefix_size + zeros + size;
+                        if(width > total && false == left)
+                        {
+                                if(true == zero && true == numeric && (true == floating || 0 > precision))
+                                        zeros += width - total;
+                                else
+                                        pad(' ', width - total);
+                        }
+                        append(prefix, prefix_size);
+                        pad('0', zeros);
+                        append(text, size);
+                        if(width > total && true == left)
+                                pad(' ', width - total);
+                }
+                return cur - out;
+        }
+
+        // The slot is copied out and checked against its sequence before
+        // anything is formatted, so that raw data being rewritten meanwhile is
+        // never decoded.
+        static void dump_flight_slot(int fd, FlightSlot const& slot)
+        {
+                std::uint64_t seq = slot.seq.load(std::memory_order_acquire);
+                if(0 == seq || 0 != (seq & 1))
+                        return;
+
+                timespec time = slot.time;
+                unsigned long thread_id = slot.thread_id;
+                char const * file = slot.file;
+                std::size_t line_number = slot.line;
+                severity_t slot_severity = slot.severity;
+                char const * fmt = slot.fmt;
+                char const * event = slot.event;
+                formatter_t formatter = slot.formatter;
+                std::size_t size = std::min(slot.size, flight_text_capacity);
+                char data[flight_text_capacity];
+                std::memcpy(data, slot.data, size);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(seq != slot.seq.load(std::memory_order_relaxed))
+                        return;
+
+                char line[flight_text_capacity + 256];
+                char * cur = line;
+                char * end = line + sizeof(line);
+                auto append = [&cur, end](char const * str, std::size_t len)
+                {
+                        len = std::min<std::size_t>(len, end - cur);
+                        std::memcpy(cur, str, len);
+                        cur += len;
+                };
+
+                cur = std::to_chars(cur, end, time.tv_sec).ptr;
+                long fraction = time.tv_nsec / 1000;
+                char usec[7] = { '.' };
+                for(int i = 6; i >= 1; --i, fraction /= 10)
+                        usec[i] = '0' + fraction % 10;
+                append(usec, sizeof(usec));
+                append(" [", 2);
+                cur = std::to_chars(cur, end, thread_id).ptr;
+                append("] ", 2);
+                char const * severity = get_severity_str(slot_severity);
+                append(severity, std::strlen(severity));
+                append(": ", 2);
+                if(nullptr != formatter)
+                        cur += formatter(fmt, data, cur, flight_text_capacity);
+                else if(nullptr != event)
+                        cur += render_fields(event, std::string_view(data, size), cur, flight_text_capacity);
+                else
+                        append(data, size);
+                append(" (FROM: ", 8);
+                append(file, std::strlen(file));
+                append(":", 1);
+                cur = std::to_chars(cur, end - 1, line_number).ptr;
+                append(")\n", 2);
+
+                write_all(fd, line, cur - line);
+        }
+
+        static void crash_handler(int signo)
+        {
+                int saved_errno = errno;
+                if(false == crashing.exchange(true))
+                {
+                        int fd = '\0' == crash_dump_path[0] ? STDERR_FILENO : open(crash_dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                        if(0 <= fd)
+                        {
+                                char header[64] = "Fatal signal ";
+                                char * end = std::to_chars(header + 13, header + sizeof(header) - 32, signo).ptr;
+                                std::memcpy(end, ", flight recorder:\n", 19);
+                                write_all(fd, header, end + 19 - header);
+                                dump_flight_recorder(fd);
+                                if(STDERR_FILENO != fd)
+                                        close(fd);
+                        }
+                }
+                errno = saved_errno;
+                raise(signo);
+        }
+
+        template<class T>
+        static constexpr field_type_t field_type(void)
+        {
+                using A = std::decay_t<T>;
+                if constexpr (std::is_same_v<A, bool>)
+                        return FIELD_BOOL;
+                else if constexpr (std::is_enum_v<A> || (std::is_integral_v<A> && std::is_signed_v<A>))
+                        return FIELD_INT;
+                else if constexpr (std::is_integral_v<A>)
+                        return FIELD_UINT;
+                else if constexpr (std::is_floating_point_v<A>)
+                        return FIELD_DOUBLE;
+                else
+                {
+                        static_assert(is_cstring_v<A> || std::is_convertible_v<A const&, std::string_view>, "Unsupported field type");
+                        return FIELD_STRING;
+                }
+        }
+
+        // Returns false, leaving dst as is, when the field does not fit; strings
+        // are truncated to the room left.
+        template<class T>
+        static bool encode_field(char *& dst, char * end, Field<T> const& field)
+        {
+                constexpr field_type_t type = field_type<T>();
+                std::string_view key(field.key);
+                key = key.substr(0, UINT8_MAX);
+                std::size_t head = 2 + key.size();
+                if(static_cast<std::size_t>(end - dst) < head + sizeof(std::uint64_t))
+                        return false;
+
+                char * cur = dst;
+                *cur++ = static_cast<char>(type);
+                *cur++ = static_cast<char>(key.size());
+                std::memcpy(cur, key.data(), key.size());
+                cur += key.size();
+                if constexpr (FIELD_STRING == type)
+                {
+                        std::string_view str;
+                        if constexpr (is_cstring_v<std::decay_t<T>>)
+                                str = nullptr == field.value ? "(null)" : field.value;
+                        else
+                                str = field.value;
+                        str = str.substr(0, std::min<std::size_t>(UINT16_MAX, end - cur - sizeof(std::uint16_t)));
+                        std::uint16_t len = str.size();
+                        std::memcpy(cur, &len, sizeof(len));
+                        std::memcpy(cur + sizeof(len), str.data(), len);
+                        cur += sizeof(len) + len;
+                }
+                else if constexpr (FIELD_BOOL == type)
+                        *cur++ = field.value ? 1 : 0;
+                else
+                {
+                        using V = std::conditional_t<FIELD_INT == type, std::int64_t, std::conditional_t<FIELD_UINT == type, std::uint64_t, double>>;
+                        V value = static_cast<V>(field.value);
+                        std::memcpy(cur, &value, sizeof(value));
+                        cur += sizeof(value);
+                }
+                dst = cur;
+                return true;
+        }
+
+        static void append_field_value(std::string& out, FieldView const& field)
+        {
+                char buf[32];
+                switch(field.type)
+                {
+                case FIELD_INT:
+                        out.append(buf, std::to_chars(buf, buf + sizeof(buf), field.int_value).ptr);
+                        break;
+                case FIELD_UINT:
+                        out.append(buf, std::to_chars(buf, buf + sizeof(buf), field.uint_value).ptr);
+                        break;
+                case FIELD_DOUBLE:
+                        out.append(buf, std::to_chars(buf, buf + sizeof(buf), field.double_value).ptr);
+                        break;
+                case FIELD_BOOL:
+                        out += field.bool_value ? "true" : "false";
+                        break;
+                case FIELD_STRING:
+                        out += field.string_value;
+                        break;
+                }
+        }
+
+        // Text form of a structured record: the event followed by key=value
+        // pairs, with string values quoted when they would be ambiguous.
+        static void append_fields_text(std::string& out, char const * event, std::string_view fields)
+        {
+                out += event;
+                for_each_field(fields, [&out](FieldView const& field)
+                {
+                        out += ' ';
+                        out += field.key;
+                        out += '=';
+                        if(FIELD_STRING == field.type && (field.string_value.empty() || std::string_view::npos != field.string_value.find_first_of(" =\"")))
+                                append_json_string(out, field.string_value);
+                        else
+                                append_field_value(out, field);
+                });
+        }
+
+        static void append_json_field(std::string& out, FieldView const& field)
+        {
+                out += ',';
+                append_json_string(out, field.key);
+                out += ':';
+                if(FIELD_STRING == field.type)
+                        append_json_string(out, field.string_value);
+                else if(FIELD_DOUBLE == field.type && false == std::isfinite(field.double_value))
+                        out += "null";
+                else
+                        append_field_value(out, field);
+        }
+
+        static void copy_record(Record& dst, Record const& src)
+        {
+                dst.severity = src.severity;
+                dst.file = src.file;
+                dst.line = src.line;
+                dst.time = src.time;
+                dst.thread_id = src.thread_id;
+                dst.fmt = src.fmt;
+                dst.event = src.event;
+                dst.decoder = src.decoder;
+                dst.formatter = src.formatter;
+                dst.size = src.size;
+                std::memcpy(dst.data, src.data, src.size);
+                dst.overflow = src.overflow;
+        }
+
+        static std::string_view message_of(Record const& record, std::string& scratch)
+        {
+                if(nullptr != record.overflow)
+                        return *record.overflow;
+                if(nullptr == record.decoder)
+                        return std::string_view(record.data, record.size);
+                record.decoder(record, scratch);
+                return scratch;
+        }
+
+        template<class A>
+        static std::size_t encoded_size(A const& arg)
+        {
+                if constexpr (is_cstring_v<A>)
+                        return sizeof(std::size_t) + std::strlen(nullptr == arg ? "(null)" : arg) + 1;
+                else
+                        return sizeof(A);
+        }
+
+        // capture_deferred has checked that the arguments fit; the bound against
+        // end repeats it where the compiler can see it.
+        template<class A>
+        static char * encode(char * dst, char * end, A const& arg)
+        {
+                if constexpr (is_cstring_v<A>)
+                {
+                        char const * str = nullptr == arg ? "(null)" : arg;
+                        std::size_t len = std::strlen(str) + 1;
+                        if(std::size_t(end - dst) < sizeof(len) + len)
+                                return end;
+                        std::memcpy(dst, &len, sizeof(len));
+                        std::memcpy(dst + sizeof(len), str, len);
+                        return dst + sizeof(len) + len;
+                }
+                else
+                {
+                        if(std::size_t(end - dst) < sizeof(A))
+                                return end;
+                        std::memcpy(dst, &arg, sizeof(A));
+                        return dst + sizeof(A);
+                }
+        }
+
+        template<class A>
+        static auto decode(char const *& src)
+        {
+                if constexpr (is_cstring_v<A>)
+                {
+                        std::size_t len;
+                        std::memcpy(&len, src, sizeof(len));
+                        char const * str = src + sizeof(len);
+                        src += sizeof(len) + len;
+                        return str;
+                }
+                else
+                {
+                        A arg;
+                        std::memcpy(&arg, src, sizeof(A));
+                        src += sizeof(A);
+                        return arg;
+                }
+        }
+
+        template<class ...A>
+        static void decode_record(Record const& record, std::string& message)
+        {
+                char const * src = record.data;
+                std::tuple<decltype(decode<A>(src))...> args{ decode<A>(src)... };
+                message = std::apply([&](auto const& ... arg) { return format(record.fmt, arg...); }, args);
+        }
+
+        // Stores the raw arguments in the record instead of formatting them.
+        // Returns false when they cannot be stored raw, so that the caller formats
+        // in place.
+        template<typename ...T>
+        static bool capture_deferred(Record& record, T const& ... args)
+        {
+                if constexpr (false == ((std::is_trivially_copyable_v<stored_t<T>> && false == std::is_class_v<stored_t<T>>) && ...))
+                        return false;
                 else
-                        std::osyncstream(out) << get_severity_color_str(severity) << std::put_time(cur_time_local, "%Y%m%d%H%M%S") << " [" << std::this_thread::get_id() << "] " << get_severity_str(severity) << ": " << this->format(fmt, std::forward<T>(args)...) << get_severity_color_str(Logger::severity_t::INFO) << std::endl;
+                {
+                        std::size_t size = (std::size_t(0) + ... + encoded_size<stored_t<T>>(args));
+                        if(size > record_capacity)
+                                return false;
+
+                        record.decoder = &Logger::decode_record<stored_t<T>...>;
+                        record.formatter = &Logger::format_raw<stored_t<T>...>;
+                        record.size = size;
+                        char * dst = record.data;
+                        char * end = record.data + record_capacity;
+                        ((dst = encode<stored_t<T>>(dst, end, args)), ...);
+                        return true;
+                }
         }
 
+        // Runtime formatting, used by the sinks for deferred records whose
+        // format strings were already validated by format_string.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
         template<typename ... Args>
-        std::string format( char const * format, Args&& ... args )
+        static std::string format( char const * format, Args&& ... args )
         {
             int size_s = std::snprintf( nullptr, 0, format, args ... ) + 1; 
             if( size_s <= 0 ){ throw std::runtime_error( "Error during formatting." ); }
@@ -130,4 +2540,150 @@ private:
             std::snprintf( buf.get(), size, format, args ... );
             return std::string( buf.get(), buf.get() + size - 1 ); 
         }
+#pragma GCC diagnostic pop
+
+        template<class A>
+        static RawArg raw_arg(A const& arg)
+        {
+                RawArg res{};
+                if constexpr (std::is_enum_v<A>)
+                        return raw_arg(static_cast<std::underlying_type_t<A>>(arg));
+                else if constexpr (is_cstring_v<A>)
+                {
+                        res.kind = RawArg::STRING;
+                        res.string_value = arg;
+                        res.bits = reinterpret_cast<std::uintptr_t>(arg);
+                }
+                else if constexpr (std::is_null_pointer_v<A>)
+                        res.kind = RawArg::INTEGER;
+                else if constexpr (std::is_pointer_v<A>)
+                {
+                        res.kind = RawArg::INTEGER;
+                        res.bits = reinterpret_cast<std::uintptr_t>(arg);
+                }
+                else if constexpr (std::is_same_v<A, long double>)
+                {
+                        res.kind = RawArg::LONG_DOUBLE;
+                        res.long_double_value = arg;
+                }
+                else if constexpr (std::is_floating_point_v<A>)
+                {
+                        res.kind = RawArg::FLOATING;
+                        res.double_value = arg;
+                }
+                else
+                {
+                        using promoted_t = decltype(+arg);
+                        res.kind = RawArg::INTEGER;
+                        res.size = sizeof(promoted_t);
+                        res.bits = static_cast<std::make_unsigned_t<promoted_t>>(+arg);
+                }
+                return res;
+        }
+
+        template<class ...A>
+        static std::size_t format_raw(char const * fmt, char const * src, char * out, std::size_t capacity)
+        {
+                std::tuple<decltype(decode<A>(src))...> args{ decode<A>(src)... };
+                return std::apply([&](auto const& ... arg)
+                {
+                        RawArg const raw[sizeof...(A) + 1] = { raw_arg(arg)..., RawArg{} };
+                        return format_signal_safe(fmt, raw, sizeof...(A), out, capacity);
+                }, args);
+        }
 };
+
+inline Logger::CallSite::CallSite(char const * file, std::size_t line)
+        : m_file(file)
+        , m_line(line)
+        , m_next(nullptr)
+        , m_mode(0)
+        , m_interval_ns(0)
+        , m_tolerance_ns(0)
+        , m_sample_every(1)
+        , m_arrival_ns(0)
+        , m_sample_count(0)
+        , m_suppressed(0)
+        , m_reported_ns(0)
+{
+        std::lock_guard<std::mutex> lg(Logger::sites_mutex);
+        for(auto const& rule : Logger::site_rules)
+                if(true == Logger::rule_matches(rule, *this))
+                        Logger::configure_site(*this, rule);
+        m_next = Logger::sites;
+        Logger::sites = this;
+}
+
+// Sampling keeps every n-th record; rate limiting is a GCRA token bucket over a
+// single atomic theoretical arrival time. Suppressions are summarised in a line
+// for the site at most once per second, ahead of an admitted record.
+inline bool Logger::CallSite::admit_limited(std::uint32_t mode, Logger& logger)
+{
+        if(0 != (mode & SAMPLED) && 0 != m_sample_count.fetch_add(1, std::memory_order_relaxed) % m_sample_every.load(std::memory_order_relaxed))
+        {
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+        }
+
+        if(0 != (mode & RATE_LIMITED))
+        {
+                std::uint64_t now = Logger::monotonic_ns();
+                std::uint64_t interval = m_interval_ns.load(std::memory_order_relaxed);
+                std::uint64_t tolerance = m_tolerance_ns.load(std::memory_order_relaxed);
+                std::uint64_t arrival = m_arrival_ns.load(std::memory_order_relaxed);
+                do
+                {
+                        if(arrival > now + tolerance)
+                        {
+                                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                                return false;
+                        }
+                }
+                while(false == m_arrival_ns.compare_exchange_weak(arrival, std::max(arrival, now) + interval, std::memory_order_relaxed));
+        }
+
+        if(0 != m_suppressed.load(std::memory_order_relaxed))
+        {
+                std::uint64_t now = Logger::monotonic_ns();
+                std::uint64_t reported = m_reported_ns.load(std::memory_order_relaxed);
+                if(now - reported >= 1000000000 && true == m_reported_ns.compare_exchange_strong(reported, now, std::memory_order_relaxed))
+                        logger.report_suppressed(*this);
+        }
+        return true;
+}
+
+// Records below LOGGER_MIN_SEVERITY compile to nothing; records below the
+// runtime threshold are rejected before their arguments are evaluated, unless
+// the flight recorder is on. Those then go to the recorder alone, bypassing
+// the call site's sampling and rate limit, so that they neither use up its
+// budget nor report suppressions to the sinks.
+#ifndef LOGGER_MIN_SEVERITY
+#define LOGGER_MIN_SEVERITY Logger::DEBUG
+#endif
+
+#define LOGGER_EMIT(logger, method, severity, ...) \
+        do \
+        { \
+                if((severity) >= (LOGGER_MIN_SEVERITY)) \
+                { \
+                        Logger& log_target = (logger); \
+                        if(true == log_target.is_enabled(severity)) \
+                        { \
+                                static Logger::CallSite log_call_site(__FILE__, __LINE__); \
+                                if(true == log_call_site.admit(log_target)) \
+                                        log_target.method(severity, __FILE__, __LINE__, __VA_ARGS__); \
+                        } \
+                        else if(true == Logger::is_flight_recording()) \
+                                log_target.method(severity, __FILE__, __LINE__, __VA_ARGS__); \
+                } \
+        } \
+        while(0)
+
+#define LOGF_TO(logger, severity, ...) LOGGER_EMIT(logger, emit, severity, __VA_ARGS__)
+
+#define LOGF(severity, ...) LOGF_TO(Logger::get_default(), severity, __VA_ARGS__)
+
+// LOGKV(Logger::INFO, "task_done", Logger::kv("task_id", id), Logger::kv("latency_ns", ns))
+#define LOGKV_TO(logger, severity, ...) LOGGER_EMIT(logger, emit_kv, severity, __VA_ARGS__)
+
+#define LOGKV(severity, ...) LOGKV_TO(Logger::get_default(), severity, __VA_ARGS__)
@@ -0,0 +1,115 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <filesystem>
+#include <logger.h>
+
+// Records per second through a FileSink, from several producer threads to a
+// file: written on the caller's thread, by an async writer, by an async
+// writer formatting deferred records, and by an async writer rotating the
+// file every MiB.
+//
+// Then the cost per record of structured records (LOGKV) against printf-style
+// ones (LOGF) carrying the same values, rendered as text, JSON and binary
+// frames by a synchronous sink writing to /dev/null: every row pays the same
+// write, so the rows differ by their serialization.
+//
+// usage: logger_bench [records per thread] [threads]
+
+namespace
+{
+
+struct Case
+{
+	char const* m_name;
+	std::size_t m_async_capacity;
+	bool m_deferred;
+	std::size_t m_max_bytes;
+};
+
+double run(Case const& c, std::filesystem::path const& dir, std::size_t records, std::size_t threads)
+{
+	std::string path = (dir / c.m_name).string();
+	auto begin = std::chrono::steady_clock::now();
+	{
+		Logger logger;
+		auto& sink = logger.add_sink(std::make_unique<Logger::FileSink>(path.c_str(), Logger::DEBUG, false, true, c.m_async_capacity));
+		sink.set_rotation({ c.m_max_bytes, std::chrono::seconds(0), false });
+		logger.set_deferred(c.m_deferred);
+
+		std::vector<std::thread> producers;
+		for (std::size_t t = 0; t < threads; ++t)
+		{
+			producers.emplace_back([&logger, records, t]() {
+				for (std::size_t i = 0; i < records; ++i)
+					LOGF_TO(logger, Logger::INFO, "record %zu of producer %zu, value %f", i, t, i * 0.5);
+			});
+		}
+		for (auto& p : producers)
+			p.join();
+	}
+	// The logger is destroyed above, so the writer has drained its ring.
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+	return records * threads / elapsed.count();
+}
+
+template<class S, class Log>
+void serialization(char const * name, std::size_t records, Log log)
+{
+	Logger logger;
+	logger.add_sink(std::make_unique<S>("/dev/null"));
+	for (std::size_t i = 0; i < records / 10; ++i)
+		log(logger, i);
+
+	auto begin = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < records; ++i)
+		log(logger, i);
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - begin;
+	std::cout << name << '\t' << static_cast<std::uint64_t>(elapsed.count() / records) << " ns/record" << std::endl;
+}
+
+void serialization(std::size_t records)
+{
+	auto logf = [](Logger& logger, std::size_t i) {
+		LOGF_TO(logger, Logger::INFO, "task_done task_id=%zu latency_ns=%ld ratio=%f ok=%s worker=%s", i, static_cast<long>(i * 7), i * 0.5, 0 == i % 2 ? "true" : "false", "pool-worker-3");
+	};
+	auto logkv = [](Logger& logger, std::size_t i) {
+		LOGKV_TO(logger, Logger::INFO, "task_done", Logger::kv("task_id", i), Logger::kv("latency_ns", static_cast<long>(i * 7)), Logger::kv("ratio", i * 0.5), Logger::kv("ok", 0 == i % 2), Logger::kv("worker", "pool-worker-3"));
+	};
+
+	std::cout << "serialization, 1 thread, synchronous sink to /dev/null" << std::endl;
+	serialization<Logger::FileSink>("text LOGF", records, logf);
+	serialization<Logger::FileSink>("text LOGKV", records, logkv);
+	serialization<Logger::JsonSink>("json LOGF", records, logf);
+	serialization<Logger::JsonSink>("json LOGKV", records, logkv);
+	serialization<Logger::BinarySink>("binary LOGF", records, logf);
+	serialization<Logger::BinarySink>("binary LOGKV", records, logkv);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t records = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+	std::size_t threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / ("logger_bench." + std::to_string(getpid()));
+	std::filesystem::create_directories(dir);
+
+	Case const cases[] = {
+		{ "sync", 0, false, 0 },
+		{ "async", 8192, false, 0 },
+		{ "async_deferred", 8192, true, 0 },
+		{ "async_rotating", 8192, false, 1 << 20 },
+	};
+	for (auto const& c : cases)
+		std::cout << c.m_name << ":\t" << static_cast<std::uint64_t>(run(c, dir, records, threads)) << " records/s (" << threads << " threads)" << std::endl;
+
+	std::filesystem::remove_all(dir);
+
+	serialization(records);
+	return 0;
+}
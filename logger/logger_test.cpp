@@ -0,0 +1,187 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <climits>
+#include <cstdint>
+#include <logger.h>
+
+// Regression checks for Logger; returns non-zero on the first failure.
+
+namespace
+{
+
+int failures = 0;
+
+void check(bool condition, char const* what)
+{
+	if (false == condition)
+	{
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+std::size_t count(std::string const& line, char c)
+{
+	std::size_t res = 0;
+	for (char x : line)
+		res += c == x;
+	return res;
+}
+
+// A field that does not fit used to leave the record size at the end of
+// the staging buffer, so the stale bytes of an earlier, longer record were
+// decoded as fields.
+void oversized_field_after_dirty_staging(void)
+{
+	Logger logger;
+	auto& sink = logger.add_sink(std::make_unique<Logger::MemorySink>(4, Logger::DEBUG, false));
+	std::string first(1010, 'x');
+	std::string second(1012, 'y');
+	LOGKV_TO(logger, Logger::INFO, "first", Logger::kv("a", first));
+	LOGKV_TO(logger, Logger::INFO, "second", Logger::kv("a", second), Logger::kv("b", 5));
+
+	auto lines = sink.snapshot();
+	check(2 == lines.size(), "both records are rendered");
+	if (2 != lines.size())
+		return;
+	check(std::string::npos != lines[1].find("second"), "the event is rendered");
+	check(1 == count(lines[1], '='), "only the field that fits is rendered");
+	check(std::string::npos == lines[1].find("b="), "the field that does not fit is dropped");
+}
+
+// Messages longer than a record used to be cut at record_capacity; they
+// must reach synchronous and asynchronous sinks whole.
+void long_message_is_not_truncated(void)
+{
+	std::string message(3 * Logger::record_capacity, 'm');
+	message.back() = '$';
+	for (std::size_t async_capacity : { std::size_t(0), std::size_t(4) })
+	{
+		Logger logger;
+		auto& sink = logger.add_sink(std::make_unique<Logger::MemorySink>(4, Logger::DEBUG, false, async_capacity));
+		LOGF_TO(logger, Logger::INFO, "%s", message.c_str());
+		LOGF_TO(logger, Logger::INFO, "short %d", 1);
+
+		std::vector<std::string> lines;
+		for (int i = 0; i < 1000 && 2 > lines.size(); ++i, std::this_thread::sleep_for(std::chrono::milliseconds(1)))
+			lines = sink.snapshot();
+		check(2 == lines.size(), "both records are rendered");
+		if (2 != lines.size())
+			continue;
+		check(std::string::npos != lines[0].find(message), "the long message is rendered whole");
+		check(std::string::npos != lines[1].find("short 1"), "the next record is rendered from its own data");
+	}
+}
+
+std::string dump_flight_recorder(void)
+{
+	char path[] = "/tmp/logger_test.XXXXXX";
+	int fd = mkstemp(path);
+	check(0 <= fd, "a temporary file is created");
+	if (0 > fd)
+		return std::string();
+	Logger::dump_flight_recorder(fd);
+	std::string res(16384, '\0');
+	ssize_t size = pread(fd, res.data(), res.size(), 0);
+	res.resize(0 < size ? size : 0);
+	close(fd);
+	unlink(path);
+	return res;
+}
+
+// Records below the threshold reach the flight recorder unformatted, and
+// are only formatted by the dump.
+void flight_recorder_formats_raw_records_on_dump(void)
+{
+	Logger logger;
+	logger.set_min_severity(Logger::INFO);
+	Logger::enable_flight_recorder(4);
+	LOGF_TO(logger, Logger::DEBUG, "raw %d %s", 42, "args");
+	LOGKV_TO(logger, Logger::DEBUG, "raw_fields", Logger::kv("id", 7), Logger::kv("ok", true));
+	Logger::disable_flight_recorder();
+
+	std::string dump = dump_flight_recorder();
+	check(std::string::npos != dump.find("DEBUG: raw 42 args"), "a raw message is formatted by the dump");
+	check(std::string::npos != dump.find("DEBUG: raw_fields id=7 ok=true"), "raw fields are rendered by the dump");
+}
+
+// Records below the threshold are only emitted for the flight recorder.
+// They used to go through their call site's sampling, using up its budget,
+// and to report their suppressions to the sinks as warnings.
+void recorder_only_records_skip_call_site_limits(void)
+{
+	Logger logger;
+	auto& sink = logger.add_sink(std::make_unique<Logger::MemorySink>(8, Logger::DEBUG, false));
+	logger.set_min_severity(Logger::INFO);
+	Logger::set_sampling(__FILE__, 0, 2);
+	Logger::enable_flight_recorder(4);
+	for (int i = 1; i <= 4; ++i)
+		LOGF_TO(logger, Logger::DEBUG, "sampled %d", i);
+	Logger::disable_flight_recorder();
+	Logger::set_sampling(__FILE__, 0, 1);
+
+	check(true == sink.snapshot().empty(), "nothing below the threshold reaches the sink");
+	std::string dump = dump_flight_recorder();
+	for (char const* text : { "sampled 1", "sampled 2", "sampled 3", "sampled 4" })
+		check(std::string::npos != dump.find(text), "every record below the threshold is recorded");
+}
+
+// The dump formats raw records without snprintf(), which is not
+// async-signal-safe; its output must still match snprintf()'s.
+template<class ...A>
+void check_dump_format(Logger& logger, Logger::format_string<std::decay_t<A>...> fmt, A ... args)
+{
+	char expected[512];
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
+	std::snprintf(expected, sizeof(expected), fmt.get(), args...);
+#pragma GCC diagnostic pop
+
+	Logger::enable_flight_recorder(4);
+	LOGF_TO(logger, Logger::DEBUG, fmt, args...);
+	Logger::disable_flight_recorder();
+	std::string dump = dump_flight_recorder();
+	if (std::string::npos == dump.find(std::string("DEBUG: ") + expected + " (FROM:"))
+	{
+		std::cerr << "expected: " << expected << "\n" << dump << std::endl;
+		check(false, "the dump formats like snprintf()");
+	}
+}
+
+void flight_recorder_dump_matches_printf(void)
+{
+	Logger logger;
+	logger.set_min_severity(Logger::INFO);
+	check_dump_format(logger, "%d|%i|%u|%x|%X|%o", -42, 7, 4000000000u, 255u, 255u, 8u);
+	check_dump_format(logger, "%5d|%-5d|%05d|%+d|% d|%.3d|%.0d", 42, 42, 42, 42, 42, 7, 0);
+	check_dump_format(logger, "%#x|%#o|%#X|%-#6x|%08.3x", 255u, 8u, 0u, 10u, 10u);
+	check_dump_format(logger, "%u|%hd|%hhu|%lld|%zu|%ld", -1, 70000, 300, LLONG_MIN, SIZE_MAX, -5L);
+	check_dump_format(logger, "%c|%s|%.2s|%8s|%-8s|", 'A', "text", "text", "right", "left");
+	check_dump_format(logger, "%p|%p|%20p", reinterpret_cast<void*>(0x1234), nullptr, reinterpret_cast<void*>(0xbeef));
+	check_dump_format(logger, "%f|%.2f|%e|%.3E|%g|%G", 3.14159, 2.5, 12345.678, 0.000123, 0.0001, 1e20);
+	check_dump_format(logger, "%10.3f|%-10.1f|%+f|%010.2f|% .1e|%.0f", -3.14159, 2.25, 1.0, -1.5, 2.0, 0.5);
+	check_dump_format(logger, "%a|%A|%.2a|%g|%.10g", 1.5, 0.1, 1.0, 100000.0, 1.0 / 3);
+	check_dump_format(logger, "%Lf|%Lg|%.3Le", 1.25L, 1e-5L, 12345.0L);
+	check_dump_format(logger, "%f|%F|%5.1f|%-6f|", INFINITY, -INFINITY, NAN, INFINITY);
+	check_dump_format(logger, "%%|100%%|%d%%", 3);
+}
+
+}
+
+int main(int, char**)
+{
+	oversized_field_after_dirty_staging();
+	long_message_is_not_truncated();
+	flight_recorder_formats_raw_records_on_dump();
+	flight_recorder_dump_matches_printf();
+	recorder_only_records_skip_call_site_limits();
+	if (0 != failures)
+		return 1;
+	std::cout << "logger_test passed" << std::endl;
+	return 0;
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <span>
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <stdexcept>
+#include <string_view>
+#include "ring_queue.h"
+
+class BufferPool;
+
+// Owns one buffer of a BufferPool, and gives it back when destroyed. A
+// Message is filled in place and moved through the queues; moving it
+// copies the handle, never the payload. It must not outlive its pool.
+class Message final
+{
+	friend class BufferPool;
+
+	BufferPool* m_pool;
+	std::uint32_t m_index;
+	std::uint32_t m_size;
+
+	Message(BufferPool* pool, std::uint32_t index)
+		: m_pool(pool)
+		, m_index(index)
+		, m_size(0)
+	{
+	}
+
+public:
+	// An empty handle, owning no buffer.
+	Message(void)
+		: m_pool(nullptr)
+		, m_index(0)
+		, m_size(0)
+	{
+	}
+
+	Message(const Message&) = delete;
+
+	Message& operator=(const Message&) = delete;
+
+	Message(Message&& other) noexcept
+		: m_pool(std::exchange(other.m_pool, nullptr))
+		, m_index(other.m_index)
+		, m_size(std::exchange(other.m_size, 0))
+	{
+	}
+
+	Message& operator=(Message&& other) noexcept
+	{
+		if (this != &other)
+		{
+			this->release();
+			m_pool = std::exchange(other.m_pool, nullptr);
+			m_index = other.m_index;
+			m_size = std::exchange(other.m_size, 0);
+		}
+		return *this;
+	}
+
+	~Message(void)
+	{
+		this->release();
+	}
+
+	bool valid(void) const
+	{
+		return nullptr != m_pool;
+	}
+
+	inline char* data(void);
+	inline char const* data(void) const;
+	inline std::size_t capacity(void) const;
+
+	std::size_t size(void) const
+	{
+		return m_size;
+	}
+
+	void resize(std::size_t size)
+	{
+		if (size > this->capacity())
+			throw std::runtime_error("Message size exceeds its buffer");
+		m_size = static_cast<std::uint32_t>(size);
+	}
+
+	// The whole buffer, to be filled before resize().
+	std::span<char> buffer(void)
+	{
+		return std::span<char>(this->data(), this->capacity());
+	}
+
+	std::string_view view(void) const
+	{
+		return std::string_view(this->data(), m_size);
+	}
+
+	inline void release(void);
+};
+
+// A fixed set of equally sized buffers carved out of one arena, so that
+// passing messages around allocates nothing once the pool exists. Free
+// buffers are kept on a lock-free stack of indices; the top carries a tag
+// bumped on every change, so that a pop racing with a pop and push of the
+// same buffer fails its CAS.
+//
+// acquire() blocks while every buffer is in use, which bounds the memory
+// of a producer/consumer set to the pool: size it for the queue capacity
+// plus what the threads hold at once.
+class BufferPool final
+{
+	friend class Message;
+
+	static constexpr std::size_t cache_line = 64;
+	static constexpr std::uint32_t none = UINT32_MAX;
+
+	struct alignas(cache_line) Line
+	{
+		char m_bytes[cache_line];
+	};
+
+public:
+	BufferPool(std::size_t buffer_size, std::size_t count)
+		: m_buffer_size(buffer_size)
+		, m_lines((buffer_size + cache_line - 1) / cache_line)
+		, m_count(count)
+		, m_arena(new Line[m_lines * count])
+		, m_next(new std::atomic<std::uint32_t>[count])
+		, m_free(0)
+		, m_closed(false)
+	{
+		if (0 == count || count >= none || buffer_size > UINT32_MAX)
+			throw std::runtime_error("Invalid BufferPool size");
+		for (std::size_t i = 0; i < count; ++i)
+			m_next[i].store(i + 1 < count ? static_cast<std::uint32_t>(i + 1) : none, std::memory_order_relaxed);
+	}
+
+	BufferPool(const BufferPool&) = delete;
+
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	BufferPool(BufferPool&&) = delete;
+
+	BufferPool& operator=(BufferPool&&) = delete;
+
+	std::size_t buffer_size(void) const
+	{
+		return m_buffer_size;
+	}
+
+	std::size_t capacity(void) const
+	{
+		return m_count;
+	}
+
+	// Returns an empty Message when every buffer is in use.
+	Message try_acquire(void)
+	{
+		std::uint32_t index = this->pop();
+		return none == index ? Message() : Message(this, index);
+	}
+
+	// Returns an empty Message only once close() has been called.
+	Message acquire(void)
+	{
+		for (std::size_t round = 0; ; ++round)
+		{
+			std::uint32_t index = this->pop();
+			if (none != index)
+				return Message(this, index);
+			if (true == m_closed.load(std::memory_order_acquire))
+				return Message();
+			m_released.wait(round, m_closed, [this]() { return none == top(m_free.load(std::memory_order_relaxed)); });
+		}
+	}
+
+	// Wakes every blocked acquire() for good.
+	void close(void)
+	{
+		m_closed.store(true, std::memory_order_release);
+		m_released.wake_all();
+	}
+
+private:
+	static std::uint32_t top(std::uint64_t free)
+	{
+		return static_cast<std::uint32_t>(free);
+	}
+
+	static std::uint64_t pack(std::uint64_t free, std::uint32_t index)
+	{
+		return ((free >> 32) + 1) << 32 | index;
+	}
+
+	std::uint32_t pop(void)
+	{
+		std::uint64_t free = m_free.load(std::memory_order_acquire);
+		while (none != top(free))
+		{
+			std::uint32_t next = m_next[top(free)].load(std::memory_order_relaxed);
+			if (true == m_free.compare_exchange_weak(free, pack(free, next), std::memory_order_acquire, std::memory_order_acquire))
+				return top(free);
+		}
+		return none;
+	}
+
+	void push(std::uint32_t index)
+	{
+		std::uint64_t free = m_free.load(std::memory_order_relaxed);
+		do
+			m_next[index].store(top(free), std::memory_order_relaxed);
+		while (false == m_free.compare_exchange_weak(free, pack(free, index), std::memory_order_release, std::memory_order_relaxed));
+		m_released.notify();
+	}
+
+	char* data(std::uint32_t index) const
+	{
+		return m_arena[index * m_lines].m_bytes;
+	}
+
+	std::size_t const m_buffer_size;
+	std::size_t const m_lines;
+	std::size_t const m_count;
+	std::unique_ptr<Line[]> const m_arena;
+	std::unique_ptr<std::atomic<std::uint32_t>[]> const m_next;
+	// The tag in the upper half, the index of the top buffer in the lower.
+	alignas(cache_line) std::atomic<std::uint64_t> m_free;
+	std::atomic<bool> m_closed;
+	WaitPoint m_released;
+};
+
+char* Message::data(void)
+{
+	return nullptr != m_pool ? m_pool->data(m_index) : nullptr;
+}
+
+char const* Message::data(void) const
+{
+	return nullptr != m_pool ? m_pool->data(m_index) : nullptr;
+}
+
+std::size_t Message::capacity(void) const
+{
+	return nullptr != m_pool ? m_pool->buffer_size() : 0;
+}
+
+void Message::release(void)
+{
+	if (nullptr == m_pool)
+		return;
+	std::exchange(m_pool, nullptr)->push(m_index);
+	m_size = 0;
+}
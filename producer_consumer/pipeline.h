@@ -0,0 +1,453 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
+#include <logger.h>
+#include "producer_consumer.h"
+#include "sharded_queue.h"
+
+// Chains a source, any number of stages and a sink:
+//
+//	auto p = Pipeline::source("read", generate, 1)
+//		.stage("parse", parse, 4)
+//		.fuse("validate", validate)
+//		.sink("write", write, 1, 128, true);
+//	p->start();
+//
+// The source runs on Producer threads, every other stage on Consumer
+// threads, parallelism of each. Adjacent stages are joined by a bounded
+// ShardedQueue with one shard per upstream thread, so a full queue blocks
+// the upstream stage. fuse() runs a stage on the threads of the previous
+// one, in the same call, saving the hand-off for cheap stages. The
+// functions of a stage are called concurrently by its threads.
+//
+// Items carry the sequence number the source gave them. An ordered sink
+// reorders them back, and calls its function under a lock, in sequence
+// order. stop() stops the source, waits for the items in flight to reach
+// the sink, then stops the remaining stages. A pipeline runs once.
+//
+// stop() joins the source threads, so it waits for a call to generate()
+// in progress to return. A source that can block, on a pool or a socket
+// say, takes an interrupt function; stop() calls it first, and from then
+// on generate() must return without blocking. What it returns still
+// flows down the pipeline.
+class Pipeline final
+{
+	template<class T>
+	struct Envelope
+	{
+		std::uint64_t m_sequence;
+		T m_value;
+	};
+
+	template<class T>
+	using Queue = ShardedQueue<Envelope<T>>;
+
+	// Where the threads of a stage put their results, worker being the
+	// index of the calling thread within the stage.
+	template<class T>
+	class Output
+	{
+	public:
+		virtual ~Output(void) = default;
+		virtual void emit(std::size_t worker, std::uint64_t sequence, T&& value) = 0;
+	};
+
+	template<class T>
+	class QueueOutput final : public Output<T>
+	{
+		Queue<T>& m_queue;
+		std::atomic<bool> const& m_stop;
+	public:
+		QueueOutput(Queue<T>& queue, std::atomic<bool> const& stop)
+			: m_queue(queue)
+			, m_stop(stop)
+		{
+		}
+
+		void emit(std::size_t worker, std::uint64_t sequence, T&& value) override
+		{
+			m_queue.push(worker, Envelope<T>{sequence, std::move(value)}, m_stop);
+		}
+	};
+
+	// A fused stage: maps the value and hands it to the next output on
+	// the same thread.
+	template<class T, class F>
+	class MappedOutput final : public Output<T>
+	{
+		using R = std::invoke_result_t<F&, T&&>;
+
+		F m_map;
+		std::shared_ptr<Output<R>> m_next;
+	public:
+		MappedOutput(F map, std::shared_ptr<Output<R>> next)
+			: m_map(std::move(map))
+			, m_next(std::move(next))
+		{
+		}
+
+		void emit(std::size_t worker, std::uint64_t sequence, T&& value) override
+		{
+			m_next->emit(worker, sequence, m_map(std::move(value)));
+		}
+	};
+
+	template<class T>
+	class Reorder final
+	{
+		std::mutex m_mutex;
+		std::uint64_t m_next;
+		std::map<std::uint64_t, T> m_pending;
+		std::function<void(T&)> m_consume;
+	public:
+		explicit Reorder(std::function<void(T&)> consume)
+			: m_next(0)
+			, m_consume(std::move(consume))
+		{
+		}
+
+		void push(std::uint64_t sequence, T&& value)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (sequence != m_next)
+			{
+				m_pending.emplace(sequence, std::move(value));
+				return;
+			}
+			m_consume(value);
+			++m_next;
+			for (auto it = m_pending.begin(); it != m_pending.end() && it->first == m_next; it = m_pending.erase(it), ++m_next)
+				m_consume(it->second);
+		}
+
+		// Items generated while the source was stopping are dropped,
+		// leaving gaps; what is still held is consumed in order.
+		void flush(void)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (auto& item : m_pending)
+				m_consume(item.second);
+			m_pending.clear();
+		}
+	};
+
+	struct Stage
+	{
+		std::string m_name;
+		std::size_t m_parallelism = 0;
+		std::atomic<std::size_t> m_items{0};
+		// The input queue; empty for the source.
+		std::function<std::size_t(void)> m_queued;
+		std::function<std::size_t(void)> m_capacity;
+		std::function<void(void)> m_wake;
+		// Items pushed, for the source.
+		std::function<std::size_t(void)> m_produced;
+		// Set for an ordered sink.
+		std::function<void(void)> m_flush;
+		// Unblocks generate(), for the source.
+		std::function<void(void)> m_interrupt;
+		// Notified as items are handled.
+		WaitPoint m_handled;
+		std::vector<std::function<void(void)>> m_start;
+		std::vector<std::function<void(void)>> m_stop;
+	};
+
+public:
+	struct StageStats
+	{
+		std::string m_name;
+		std::size_t m_parallelism;
+		std::size_t m_items;
+		double m_items_per_second;
+		// Occupancy of the input queue, 0 for the source.
+		std::size_t m_queued;
+		std::size_t m_capacity;
+	};
+
+	// The pipeline built so far, whose last stage has no output attached
+	// yet, so that fuse() can still extend it.
+	template<class T>
+	class Builder final
+	{
+		friend class Pipeline;
+
+		template<class>
+		friend class Builder;
+
+		std::unique_ptr<Pipeline> m_pipeline;
+		Stage* m_stage = nullptr;
+		// Set while the last stage is the source.
+		std::function<T(void)> m_generate;
+		std::function<void(std::shared_ptr<Output<T>>)> m_attach;
+
+		Builder(void) = default;
+
+	public:
+		template<class F>
+		Builder<std::invoke_result_t<F&, T&&>> stage(std::string name, F map, std::size_t parallelism = 1, std::size_t capacity = 128) &&
+		{
+			using R = std::invoke_result_t<F&, T&&>;
+			static_assert(false == std::is_void_v<R>, "a stage must return a value");
+
+			Queue<T>& in = this->connect(capacity);
+			Builder<R> res;
+			Pipeline* pipeline = m_pipeline.get();
+			Stage* stage = pipeline->add_stage(std::move(name), parallelism, in);
+			res.m_attach = [pipeline, stage, &in, map](std::shared_ptr<Output<R>> out) {
+				pipeline->consume<T>(*stage, in, [map, out](std::size_t worker, Envelope<T>& item) mutable {
+					out->emit(worker, item.m_sequence, map(std::move(item.m_value)));
+				});
+			};
+			res.m_pipeline = std::move(m_pipeline);
+			res.m_stage = stage;
+			return res;
+		}
+
+		// Runs map on the threads of the last stage, right after it.
+		template<class F>
+		Builder<std::invoke_result_t<F&, T&&>> fuse(std::string name, F map) &&
+		{
+			using R = std::invoke_result_t<F&, T&&>;
+			static_assert(false == std::is_void_v<R>, "a stage must return a value");
+
+			Builder<R> res;
+			m_stage->m_name += "+" + name;
+			if (m_generate)
+				res.m_generate = [generate = std::move(m_generate), map]() mutable { return map(generate()); };
+			else
+				res.m_attach = [attach = std::move(m_attach), map](std::shared_ptr<Output<R>> out) {
+					attach(std::make_shared<MappedOutput<T, F>>(map, std::move(out)));
+				};
+			res.m_pipeline = std::move(m_pipeline);
+			res.m_stage = m_stage;
+			return res;
+		}
+
+		std::unique_ptr<Pipeline> sink(std::string name, std::function<void(T&)> consume, std::size_t parallelism = 1, std::size_t capacity = 128, bool ordered = false) &&
+		{
+			Queue<T>& in = this->connect(capacity);
+			Pipeline* pipeline = m_pipeline.get();
+			Stage* stage = pipeline->add_stage(std::move(name), parallelism, in);
+			if (false == ordered)
+			{
+				pipeline->consume<T>(*stage, in, [consume](std::size_t, Envelope<T>& item) {
+					consume(item.m_value);
+				});
+			}
+			else
+			{
+				auto reorder = std::make_shared<Reorder<T>>(std::move(consume));
+				pipeline->m_storage.push_back(reorder);
+				pipeline->consume<T>(*stage, in, [reorder](std::size_t, Envelope<T>& item) {
+					reorder->push(item.m_sequence, std::move(item.m_value));
+				});
+				stage->m_flush = [reorder]() { reorder->flush(); };
+			}
+			return std::move(m_pipeline);
+		}
+
+	private:
+		// Creates the queue the last stage writes to, and its threads.
+		Queue<T>& connect(std::size_t capacity)
+		{
+			Pipeline* pipeline = m_pipeline.get();
+			std::size_t shards = m_stage->m_parallelism;
+			auto queue = std::make_shared<Queue<T>>(shards, std::max<std::size_t>(1, (capacity + shards - 1) / shards));
+			pipeline->m_storage.push_back(queue);
+			if (m_generate)
+				pipeline->produce<T>(*m_stage, *queue, std::move(m_generate));
+			else
+				m_attach(std::make_shared<QueueOutput<T>>(*queue, pipeline->m_stop));
+			return *queue;
+		}
+	};
+
+	template<class F>
+	static Builder<std::invoke_result_t<F&>> source(std::string name, F generate, std::size_t parallelism = 1, std::function<void(void)> interrupt = nullptr)
+	{
+		Builder<std::invoke_result_t<F&>> res;
+		res.m_pipeline.reset(new Pipeline());
+		res.m_stage = res.m_pipeline->add_stage(std::move(name), parallelism);
+		res.m_stage->m_interrupt = std::move(interrupt);
+		res.m_generate = std::move(generate);
+		return res;
+	}
+
+	Pipeline(const Pipeline&) = delete;
+
+	Pipeline& operator=(const Pipeline&) = delete;
+
+	Pipeline(Pipeline&&) = delete;
+
+	Pipeline& operator=(Pipeline&&) = delete;
+
+	~Pipeline(void)
+	{
+		this->stop();
+	}
+
+	void start(void)
+	{
+		if (true == m_started)
+		{
+			LOGF(Logger::ERROR, "Pipeline has already been started");
+			throw std::runtime_error("Pipeline has already been started");
+		}
+		LOGF(Logger::INFO, "Starting pipeline...");
+		m_started = true;
+		m_running = true;
+		m_started_at = std::chrono::steady_clock::now();
+		for (auto it = m_stages.rbegin(); it != m_stages.rend(); ++it)
+			for (auto& start : (*it)->m_start)
+				start();
+	}
+
+	void stop(void)
+	{
+		if (false == m_running)
+			return;
+
+		LOGF(Logger::INFO, "Draining pipeline...");
+		Stage& source = *m_stages.front();
+		Stage& sink = *m_stages.back();
+		if (source.m_interrupt)
+			source.m_interrupt();
+		for (auto& stop : source.m_stop)
+			stop();
+		std::size_t produced = source.m_produced();
+		auto pending = [&sink, produced]() { return sink.m_items.load(std::memory_order_acquire) < produced; };
+		for (std::size_t round = 0; true == pending(); ++round)
+			sink.m_handled.wait(round, m_stop, pending);
+		if (sink.m_flush)
+			sink.m_flush();
+
+		m_stop.store(true, std::memory_order_release);
+		for (auto& stage : m_stages)
+			if (stage->m_wake)
+				stage->m_wake();
+		for (auto& stage : m_stages)
+			for (auto& stop : stage->m_stop)
+				stop();
+		m_stopped_at = std::chrono::steady_clock::now();
+		m_running = false;
+		LOGF(Logger::INFO, "Pipeline has been shut down");
+	}
+
+	// Throughput is averaged since start(), up to stop().
+	std::vector<StageStats> stats(void) const
+	{
+		auto end = true == m_running ? std::chrono::steady_clock::now() : m_stopped_at;
+		double seconds = std::chrono::duration<double>(end - m_started_at).count();
+		std::vector<StageStats> res;
+		for (auto const& stage : m_stages)
+		{
+			StageStats s;
+			s.m_name = stage->m_name;
+			s.m_parallelism = stage->m_parallelism;
+			s.m_items = stage->m_produced ? stage->m_produced() : stage->m_items.load(std::memory_order_relaxed);
+			s.m_items_per_second = true == m_started && seconds > 0 ? s.m_items / seconds : 0;
+			s.m_queued = stage->m_queued ? stage->m_queued() : 0;
+			s.m_capacity = stage->m_capacity ? stage->m_capacity() : 0;
+			res.push_back(s);
+		}
+		return res;
+	}
+
+private:
+	static constexpr std::size_t max_batch = 32;
+
+	Pipeline(void)
+		: m_stop(false)
+		, m_started(false)
+		, m_running(false)
+	{
+	}
+
+	Stage* add_stage(std::string name, std::size_t parallelism)
+	{
+		std::unique_ptr<Stage> stage(new Stage());
+		stage->m_name = std::move(name);
+		stage->m_parallelism = 0 == parallelism ? 1 : parallelism;
+		m_stages.push_back(std::move(stage));
+		return m_stages.back().get();
+	}
+
+	template<class T>
+	Stage* add_stage(std::string name, std::size_t parallelism, Queue<T>& in)
+	{
+		Stage* stage = this->add_stage(std::move(name), parallelism);
+		stage->m_queued = [&in]() { return in.size(); };
+		stage->m_capacity = [&in]() { return in.capacity(); };
+		stage->m_wake = [&in]() { in.wake_all(); };
+		return stage;
+	}
+
+	// One Producer per thread of the source, each on its own shard.
+	template<class T>
+	void produce(Stage& stage, Queue<T>& out, std::function<T(void)> generate)
+	{
+		using Shard = typename Queue<T>::Shard;
+
+		auto sequence = std::make_shared<std::atomic<std::uint64_t>>(0);
+		std::vector<Producer<Envelope<T>, Shard>*> producers;
+		for (std::size_t i = 0; i < stage.m_parallelism; ++i)
+		{
+			auto producer = std::make_shared<Producer<Envelope<T>, Shard>>(out.shard(i), [generate, sequence]() mutable {
+				std::uint64_t s = sequence->fetch_add(1, std::memory_order_relaxed);
+				return Envelope<T>{s, generate()};
+			});
+			m_storage.push_back(producer);
+			producers.push_back(producer.get());
+			stage.m_start.push_back([p = producer.get()]() { p->start(); });
+			stage.m_stop.push_back([p = producer.get()]() { p->stop(); });
+		}
+		stage.m_produced = [producers]() {
+			std::size_t res = 0;
+			for (auto* p : producers)
+				res += p->produced();
+			return res;
+		};
+	}
+
+	// One Consumer per thread of the stage, each starting on its own shard.
+	template<class T>
+	void consume(Stage& stage, Queue<T>& in, std::function<void(std::size_t, Envelope<T>&)> handle)
+	{
+		using Reader = typename Queue<T>::Reader;
+
+		for (std::size_t i = 0; i < stage.m_parallelism; ++i)
+		{
+			auto reader = std::make_shared<Reader>(in, i);
+			auto consumer = std::make_shared<Consumer<Envelope<T>, Reader>>(*reader, [handle, &stage, i](std::span<Envelope<T>> items) {
+				for (auto& item : items)
+					handle(i, item);
+				stage.m_items.fetch_add(items.size(), std::memory_order_release);
+				stage.m_handled.notify();
+			}, max_batch);
+			m_storage.push_back(reader);
+			m_storage.push_back(consumer);
+			stage.m_start.push_back([c = consumer.get()]() { c->start(); });
+			stage.m_stop.push_back([c = consumer.get()]() { c->stop(); });
+		}
+	}
+
+	std::vector<std::unique_ptr<Stage>> m_stages;
+	// Queues and threads of every stage, type erased.
+	std::vector<std::shared_ptr<void>> m_storage;
+	std::atomic<bool> m_stop;
+	bool m_started;
+	bool m_running;
+	std::chrono::steady_clock::time_point m_started_at;
+	std::chrono::steady_clock::time_point m_stopped_at;
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <span>
+#include <vector>
+#include <algorithm>
+#include <logger.h>
+#include "ring_queue.h"
+
+template<typename T, class Queue = RingQueue<T>>
+class Producer final
+{
+	Queue& m_queue;
+	std::unique_ptr<std::thread> m_runner;
+	std::function<T()> m_generator;
+	std::atomic<std::size_t> m_produced;
+	std::atomic<bool> m_stop_requested;
+	std::atomic<bool> m_stopped;
+public:
+	Producer(Queue& q, std::function<T()> generator)
+		: m_queue(q)
+		, m_generator(generator)
+		, m_produced(0)
+		, m_stop_requested(false)
+		, m_stopped(true)
+	{
+	}
+
+	Producer(const Producer&) = delete;
+
+	Producer& operator=(const Producer&) = delete;
+
+	Producer(Producer&&) = delete;
+
+	Producer& operator=(Producer&&) = delete;
+
+	void start(void)
+	{
+		LOGF(Logger::INFO, "Starting producer...");
+		try
+		{
+			m_stopped = false;
+			m_runner.reset(new std::thread(&Producer::start_internal, this));
+		}
+		catch (const std::exception& e)
+		{
+			LOGF(Logger::ERROR, "Error occurred in Producer::start(): %s", e.what());
+			this->stop();
+		}
+		catch (...)
+		{
+			LOGF(Logger::ERROR, "Unexpected error occurred in Producer::start()");
+			this->stop();
+		}
+	}
+	void stop(void)
+	{
+		if(true == this->m_stopped) return;
+
+		LOGF(Logger::INFO, "Shutting down producer...");
+		this->m_stop_requested = true;
+		this->m_queue.wake_all();
+		if (this->m_runner && m_runner->joinable())
+			this->m_runner->join();
+		LOGF(Logger::INFO, "Producer has been shut down");
+		this->m_stopped = true;
+	}
+	~Producer(void)
+	{
+		this->stop();
+	}
+
+	// Items pushed so far. An item generated while stopping is dropped and
+	// not counted.
+	std::size_t produced(void) const
+	{
+		return m_produced.load(std::memory_order_acquire);
+	}
+private:
+	void start_internal(void)
+	{
+		while (false == this->m_stop_requested.load(std::memory_order_acquire))
+		{
+			if (false == this->m_queue.push(m_generator(), this->m_stop_requested))
+				break;
+			m_produced.fetch_add(1, std::memory_order_release);
+		}
+	}
+};
+
+template<class T, class Queue = RingQueue<T>>
+class Consumer final
+{
+	Queue& m_queue;
+	std::unique_ptr<std::thread> m_runner;
+	std::function<void(T const&)> m_callback;
+	std::function<void(std::span<T>)> m_batch_callback;
+	std::size_t const m_max_batch;
+	std::atomic<bool> m_stop_requested;
+	std::atomic<bool> m_stopped;
+public:
+	Consumer(Queue& q, std::function<void(T const&)> callback)
+		: m_queue(q)
+		, m_callback(callback)
+		, m_max_batch(1)
+		, m_stop_requested(false)
+		, m_stopped(true)
+	{
+	}
+
+	// The callback receives the items popped together, up to max_batch.
+	// The batch doubles while the queue has more items than it takes, and
+	// falls back to what was available otherwise, down to a single item
+	// when the consumer keeps up.
+	Consumer(Queue& q, std::function<void(std::span<T>)> callback, std::size_t max_batch)
+		: m_queue(q)
+		, m_batch_callback(callback)
+		, m_max_batch(0 == max_batch ? 1 : max_batch)
+		, m_stop_requested(false)
+		, m_stopped(true)
+	{
+	}
+
+	Consumer(const Consumer&) = delete;
+
+	Consumer& operator=(const Consumer&) = delete;
+
+	Consumer(Consumer&&) = delete;
+
+	Consumer& operator=(Consumer&&) = delete;
+
+	void start(void)
+	{
+		LOGF(Logger::INFO, "Starting consumer...");
+                try
+                {
+			m_stopped = false;
+                        m_runner.reset(new std::thread(&Consumer::start_internal, this));
+                }
+                catch (const std::exception& e)
+                {
+                        LOGF(Logger::ERROR, "Error occurred in Consumer::start(): %s", e.what());
+			this->stop();
+		}
+                catch (...)
+                {
+                        LOGF(Logger::ERROR, "Unexpected error occurred in Consumer::start()");
+			this->stop();
+		}
+	}
+	void stop(void)
+	{
+		if(true == this->m_stopped) return;
+
+		LOGF(Logger::INFO, "Shutting down consumer...");
+                this->m_stop_requested = true;
+                this->m_queue.wake_all();
+                if (this->m_runner && m_runner->joinable())
+                        this->m_runner->join();
+                LOGF(Logger::INFO, "Consumer has been shut down");
+		this->m_stopped = true;
+	}
+	~Consumer(void)
+	{
+		this->stop();
+	}
+private:
+	void start_internal(void)
+	{
+		if (this->m_batch_callback)
+			return this->run_batches();
+
+		T item;
+		while (false == this->m_stop_requested.load(std::memory_order_acquire))
+		{
+			if (false == this->m_queue.pop(item, this->m_stop_requested))
+				break;
+			this->m_callback(item);
+		}
+	}
+
+	void run_batches(void)
+	{
+		std::vector<T> items(this->m_max_batch);
+		std::size_t batch = 1;
+		while (false == this->m_stop_requested.load(std::memory_order_acquire))
+		{
+			std::size_t count = this->m_queue.pop_n(items.data(), batch, this->m_stop_requested);
+			if (0 == count)
+				break;
+			this->m_batch_callback(std::span<T>(items.data(), count));
+			if (count == batch)
+				batch = std::min(batch * 2, this->m_max_batch);
+			else
+				batch = count;
+		}
+	}
+};
@@ -0,0 +1,420 @@
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+
+enum class queue_mode_t { SPSC, MPMC };
+
+// Lets threads sleep until a condition they are blocked on may have
+// changed. wait() spins, then yields, then sleeps on the epoch. A waiter
+// raises the sleeping flag before checking its condition, and its barrier
+// pairs with the one in notify(), so that either the check sees the
+// progress or notify() sees the flag. Only the first notify() to see the
+// flag makes the futex call; waiters still blocked raise it again.
+//
+// notify() runs once per item, wait() only on the way to sleep, so the
+// waiter pays for the ordering: membarrier() runs a full barrier on every
+// running thread of the process, which leaves notify() with a compiler
+// barrier. Where the kernel lacks private expedited membarrier, both sides
+// fall back to a seq_cst fence.
+class WaitPoint final
+{
+public:
+	template<class Blocked>
+	void wait(std::size_t round, std::atomic<bool> const& stop, Blocked blocked)
+	{
+		static constexpr std::size_t spin_rounds = 32;
+		static constexpr std::size_t yield_rounds = 8;
+		if (round < spin_rounds)
+			return cpu_relax();
+		if (round < spin_rounds + yield_rounds)
+			return std::this_thread::yield();
+
+		std::uint32_t current = m_epoch.load(std::memory_order_acquire);
+		m_sleeping.store(true, std::memory_order_relaxed);
+		heavy_barrier();
+		if (false == stop.load(std::memory_order_relaxed) && true == blocked())
+			m_epoch.wait(current, std::memory_order_acquire);
+	}
+
+	void notify(void)
+	{
+		light_barrier();
+		if (false == m_sleeping.load(std::memory_order_relaxed) || false == m_sleeping.exchange(false, std::memory_order_relaxed))
+			return;
+		m_epoch.fetch_add(1, std::memory_order_release);
+		m_epoch.notify_all();
+	}
+
+	void wake_all(void)
+	{
+		m_epoch.fetch_add(1, std::memory_order_release);
+		m_epoch.notify_all();
+	}
+
+private:
+	static bool has_membarrier(void)
+	{
+		static bool const res = 0 == syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0);
+		return res;
+	}
+
+	static void light_barrier(void)
+	{
+		if (true == has_membarrier())
+			std::atomic_signal_fence(std::memory_order_seq_cst);
+		else
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	static void heavy_barrier(void)
+	{
+		if (true == has_membarrier())
+			syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+		else
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	static void cpu_relax(void)
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield");
+#endif
+	}
+
+	std::atomic<std::uint32_t> m_epoch{0};
+	std::atomic<bool> m_sleeping{false};
+};
+
+// Bounded ring of a power of two capacity. The producer and consumer
+// indices live on separate cache lines. SPSC keeps, next to each index, a
+// cached copy of the other one, so that a side only reads the other side's
+// line when the ring looks full or empty. MPMC follows Vyukov's design:
+// every cell carries a sequence number telling whether it is ready for the
+// producer or the consumer of a given lap.
+//
+// try_push() and try_pop() never block. push() and pop() wait, on the
+// not-full and not-empty WaitPoints, until the other side makes progress
+// or the given stop flag is raised; wake_all() must be called after
+// raising it. Several rings can share an external not-empty WaitPoint, for
+// consumers waiting on any of them.
+template<class T, queue_mode_t Mode = queue_mode_t::MPMC>
+class RingQueue final
+{
+	static constexpr std::size_t cache_line = 64;
+
+	struct Cell
+	{
+		std::atomic<std::size_t> m_sequence;
+		alignas(T) unsigned char m_storage[sizeof(T)];
+
+		T* item(void)
+		{
+			return std::launder(reinterpret_cast<T*>(m_storage));
+		}
+	};
+
+public:
+	explicit RingQueue(std::size_t capacity, WaitPoint* not_empty = nullptr)
+		: m_capacity(round_up(capacity))
+		, m_mask(m_capacity - 1)
+		, m_cells(new Cell[m_capacity])
+		, m_head(0)
+		, m_cached_tail(0)
+		, m_tail(0)
+		, m_cached_head(0)
+		, m_not_empty(nullptr != not_empty ? not_empty : &m_own_not_empty)
+	{
+		for (std::size_t i = 0; i < m_capacity; ++i)
+			m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+	}
+
+	~RingQueue(void)
+	{
+		std::size_t head = m_head.load(std::memory_order_relaxed);
+		for (std::size_t pos = m_tail.load(std::memory_order_relaxed); pos != head; ++pos)
+			m_cells[pos & m_mask].item()->~T();
+	}
+
+	RingQueue(RingQueue&&) = delete;
+	RingQueue(RingQueue const&) = delete;
+	RingQueue& operator=(RingQueue&&) = delete;
+	RingQueue& operator=(RingQueue const&) = delete;
+
+	std::size_t capacity(void) const
+	{
+		return m_capacity;
+	}
+
+	// Approximate while the queue is in use.
+	std::size_t size(void) const
+	{
+		std::size_t tail = m_tail.load(std::memory_order_relaxed);
+		std::size_t head = m_head.load(std::memory_order_relaxed);
+		return head > tail ? head - tail : 0;
+	}
+
+	// item is left untouched when the queue is full.
+	template<class U>
+	bool try_push(U&& item)
+	{
+		Cell* cell = nullptr;
+		std::size_t pos = m_head.load(std::memory_order_relaxed);
+		if constexpr (queue_mode_t::SPSC == Mode)
+		{
+			if (pos - m_cached_tail >= m_capacity)
+			{
+				m_cached_tail = m_tail.load(std::memory_order_acquire);
+				if (pos - m_cached_tail >= m_capacity)
+					return false;
+			}
+			cell = &m_cells[pos & m_mask];
+			::new (cell->m_storage) T(std::forward<U>(item));
+			m_head.store(pos + 1, std::memory_order_release);
+		}
+		else
+		{
+			while (true)
+			{
+				cell = &m_cells[pos & m_mask];
+				std::size_t sequence = cell->m_sequence.load(std::memory_order_acquire);
+				std::intptr_t diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+				if (0 == diff)
+				{
+					if (true == m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+					return false;
+				else
+					pos = m_head.load(std::memory_order_relaxed);
+			}
+			::new (cell->m_storage) T(std::forward<U>(item));
+			cell->m_sequence.store(pos + 1, std::memory_order_release);
+		}
+		m_not_empty->notify();
+		return true;
+	}
+
+	bool try_pop(T& item)
+	{
+		Cell* cell = nullptr;
+		std::size_t pos = m_tail.load(std::memory_order_relaxed);
+		if constexpr (queue_mode_t::SPSC == Mode)
+		{
+			if (pos == m_cached_head)
+			{
+				m_cached_head = m_head.load(std::memory_order_acquire);
+				if (pos == m_cached_head)
+					return false;
+			}
+			cell = &m_cells[pos & m_mask];
+			item = std::move(*cell->item());
+			cell->item()->~T();
+			m_tail.store(pos + 1, std::memory_order_release);
+		}
+		else
+		{
+			while (true)
+			{
+				cell = &m_cells[pos & m_mask];
+				std::size_t sequence = cell->m_sequence.load(std::memory_order_acquire);
+				std::intptr_t diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos + 1);
+				if (0 == diff)
+				{
+					if (true == m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+					return false;
+				else
+					pos = m_tail.load(std::memory_order_relaxed);
+			}
+			item = std::move(*cell->item());
+			cell->item()->~T();
+			cell->m_sequence.store(pos + m_capacity, std::memory_order_release);
+		}
+		m_not_full.notify();
+		return true;
+	}
+
+	// Moves up to count items from first into the queue, with a single
+	// update of the producer index; returns how many were pushed.
+	template<class It>
+	std::size_t try_push_n(It first, std::size_t count)
+	{
+		std::size_t pos = m_head.load(std::memory_order_relaxed);
+		std::size_t res = 0;
+		if constexpr (queue_mode_t::SPSC == Mode)
+		{
+			if (pos - m_cached_tail + count > m_capacity)
+				m_cached_tail = m_tail.load(std::memory_order_acquire);
+			res = std::min(count, m_capacity - (pos - m_cached_tail));
+			if (0 == res)
+				return 0;
+			for (std::size_t i = 0; i < res; ++i, ++first)
+				::new (m_cells[(pos + i) & m_mask].m_storage) T(std::move(*first));
+			m_head.store(pos + res, std::memory_order_release);
+		}
+		else
+		{
+			// Claims the run of free cells starting at the head.
+			do
+			{
+				res = 0;
+				while (res < count && m_cells[(pos + res) & m_mask].m_sequence.load(std::memory_order_acquire) == pos + res)
+					++res;
+				if (0 == res)
+				{
+					std::size_t head = m_head.load(std::memory_order_relaxed);
+					if (head == pos)
+						return 0;
+					pos = head;
+					continue;
+				}
+			} while (0 == res || false == m_head.compare_exchange_weak(pos, pos + res, std::memory_order_relaxed));
+			for (std::size_t i = 0; i < res; ++i, ++first)
+			{
+				Cell& cell = m_cells[(pos + i) & m_mask];
+				::new (cell.m_storage) T(std::move(*first));
+				cell.m_sequence.store(pos + i + 1, std::memory_order_release);
+			}
+		}
+		m_not_empty->notify();
+		return res;
+	}
+
+	// Moves up to count items into out, with a single update of the
+	// consumer index; returns how many were popped.
+	std::size_t try_pop_n(T* out, std::size_t count)
+	{
+		std::size_t pos = m_tail.load(std::memory_order_relaxed);
+		std::size_t res = 0;
+		if constexpr (queue_mode_t::SPSC == Mode)
+		{
+			if (m_cached_head - pos < count)
+				m_cached_head = m_head.load(std::memory_order_acquire);
+			res = std::min(count, m_cached_head - pos);
+			if (0 == res)
+				return 0;
+			for (std::size_t i = 0; i < res; ++i)
+			{
+				T* item = m_cells[(pos + i) & m_mask].item();
+				out[i] = std::move(*item);
+				item->~T();
+			}
+			m_tail.store(pos + res, std::memory_order_release);
+		}
+		else
+		{
+			// Claims the run of filled cells starting at the tail.
+			do
+			{
+				res = 0;
+				while (res < count && m_cells[(pos + res) & m_mask].m_sequence.load(std::memory_order_acquire) == pos + res + 1)
+					++res;
+				if (0 == res)
+				{
+					std::size_t tail = m_tail.load(std::memory_order_relaxed);
+					if (tail == pos)
+						return 0;
+					pos = tail;
+					continue;
+				}
+			} while (0 == res || false == m_tail.compare_exchange_weak(pos, pos + res, std::memory_order_relaxed));
+			for (std::size_t i = 0; i < res; ++i)
+			{
+				Cell& cell = m_cells[(pos + i) & m_mask];
+				out[i] = std::move(*cell.item());
+				cell.item()->~T();
+				cell.m_sequence.store(pos + i + m_capacity, std::memory_order_release);
+			}
+		}
+		m_not_full.notify();
+		return res;
+	}
+
+	// Returns false, leaving item untouched, when stop was raised first.
+	template<class U>
+	bool push(U&& item, std::atomic<bool> const& stop)
+	{
+		for (std::size_t round = 0; false == this->try_push(std::forward<U>(item)); ++round)
+		{
+			if (true == stop.load(std::memory_order_acquire))
+				return false;
+			m_not_full.wait(round, stop, [this]() { return this->size() >= m_capacity; });
+		}
+		return true;
+	}
+
+	// Returns false when stop was raised while the queue was empty.
+	bool pop(T& item, std::atomic<bool> const& stop)
+	{
+		for (std::size_t round = 0; false == this->try_pop(item); ++round)
+		{
+			if (true == stop.load(std::memory_order_acquire))
+				return false;
+			m_not_empty->wait(round, stop, [this]() { return 0 == this->size(); });
+		}
+		return true;
+	}
+
+	// Waits for at least one item, then pops up to count of them; returns 0
+	// when stop was raised while the queue was empty.
+	std::size_t pop_n(T* out, std::size_t count, std::atomic<bool> const& stop)
+	{
+		std::size_t res = 0;
+		for (std::size_t round = 0; 0 == (res = this->try_pop_n(out, count)); ++round)
+		{
+			if (true == stop.load(std::memory_order_acquire))
+				return 0;
+			m_not_empty->wait(round, stop, [this]() { return 0 == this->size(); });
+		}
+		return res;
+	}
+
+	// Wakes every blocked push() and pop() so that they check their stop flag.
+	void wake_all(void)
+	{
+		m_not_empty->wake_all();
+		m_not_full.wake_all();
+	}
+
+private:
+	static std::size_t round_up(std::size_t capacity)
+	{
+		std::size_t res = 2;
+		while (res < capacity)
+			res <<= 1;
+		return res;
+	}
+
+	std::size_t const m_capacity;
+	std::size_t const m_mask;
+	std::unique_ptr<Cell[]> const m_cells;
+
+	// producer side
+	alignas(cache_line) std::atomic<std::size_t> m_head;
+	std::size_t m_cached_tail;
+
+	// consumer side
+	alignas(cache_line) std::atomic<std::size_t> m_tail;
+	std::size_t m_cached_head;
+
+	alignas(cache_line) WaitPoint m_not_full;
+	WaitPoint m_own_not_empty;
+	WaitPoint* const m_not_empty;
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <stdexcept>
+#include "ring_queue.h"
+
+// A set of MPMC rings, one per producer, so that producers never contend
+// with each other. Each ring signals the shared not-empty WaitPoint, and
+// keeps its own not-full one, so a push only wakes consumers and a pop
+// only wakes the producer of that shard.
+//
+// Consumers read through a Reader. A Reader starts on its own shard, keeps
+// draining it while it yields full batches, and otherwise moves on round-
+// robin, taking from whichever shard has items; it sleeps only when every
+// shard is empty.
+template<class T>
+class ShardedQueue final
+{
+public:
+	using Shard = RingQueue<T, queue_mode_t::MPMC>;
+
+	class Reader final
+	{
+	public:
+		Reader(ShardedQueue& queue, std::size_t index)
+			: m_queue(queue)
+			, m_cursor(index % queue.shard_count())
+		{
+		}
+
+		bool pop(T& item, std::atomic<bool> const& stop)
+		{
+			return 1 == m_queue.pop_n(m_cursor, &item, 1, stop);
+		}
+
+		std::size_t pop_n(T* out, std::size_t count, std::atomic<bool> const& stop)
+		{
+			return m_queue.pop_n(m_cursor, out, count, stop);
+		}
+
+		void wake_all(void)
+		{
+			m_queue.wake_all();
+		}
+
+	private:
+		ShardedQueue& m_queue;
+		std::size_t m_cursor;
+	};
+
+	ShardedQueue(std::size_t shard_count, std::size_t shard_capacity)
+	{
+		if (0 == shard_count)
+			throw std::runtime_error("ShardedQueue needs at least one shard");
+		m_shards.reserve(shard_count);
+		for (std::size_t i = 0; i < shard_count; ++i)
+			m_shards.emplace_back(new Shard(shard_capacity, &m_not_empty));
+	}
+
+	ShardedQueue(const ShardedQueue&) = delete;
+
+	ShardedQueue& operator=(const ShardedQueue&) = delete;
+
+	ShardedQueue(ShardedQueue&&) = delete;
+
+	ShardedQueue& operator=(ShardedQueue&&) = delete;
+
+	std::size_t shard_count(void) const
+	{
+		return m_shards.size();
+	}
+
+	// The ring a producer pushes to.
+	Shard& shard(std::size_t index)
+	{
+		return *m_shards[index % m_shards.size()];
+	}
+
+	std::size_t capacity(void) const
+	{
+		std::size_t res = 0;
+		for (auto const& s : m_shards)
+			res += s->capacity();
+		return res;
+	}
+
+	// Approximate while the queue is in use.
+	std::size_t size(void) const
+	{
+		std::size_t res = 0;
+		for (auto const& s : m_shards)
+			res += s->size();
+		return res;
+	}
+
+	bool push(std::size_t index, T item, std::atomic<bool> const& stop)
+	{
+		return this->shard(index).push(std::move(item), stop);
+	}
+
+	// Tries the shard at cursor first, then the following ones. cursor is
+	// left on the shard taken from, or past it when that shard ran dry.
+	std::size_t try_pop_n(std::size_t& cursor, T* out, std::size_t count)
+	{
+		std::size_t const n = m_shards.size();
+		for (std::size_t k = 0; k < n; ++k)
+		{
+			std::size_t i = (cursor + k) % n;
+			std::size_t res = m_shards[i]->try_pop_n(out, count);
+			if (0 == res)
+				continue;
+			cursor = res < count ? (i + 1) % n : i;
+			return res;
+		}
+		return 0;
+	}
+
+	std::size_t pop_n(std::size_t& cursor, T* out, std::size_t count, std::atomic<bool> const& stop)
+	{
+		std::size_t res = 0;
+		for (std::size_t round = 0; 0 == (res = this->try_pop_n(cursor, out, count)); ++round)
+		{
+			if (true == stop.load(std::memory_order_acquire))
+				return 0;
+			m_not_empty.wait(round, stop, [this]() { return 0 == this->size(); });
+		}
+		return res;
+	}
+
+	// Wakes every blocked producer and consumer so that they check their
+	// stop flag.
+	void wake_all(void)
+	{
+		for (auto& s : m_shards)
+			s->wake_all();
+	}
+
+private:
+	WaitPoint m_not_empty;
+	std::vector<std::unique_ptr<Shard>> m_shards;
+};
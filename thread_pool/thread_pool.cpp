@@ -1,220 +1,50 @@
-#include <thread>
 #include <iostream>
-#include <future>
-#include <memory>
-#include <optional>
-#include <queue>
-#include <chrono>
-#include <mutex>
 #include <functional>
-#include <condition_variable>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <sstream>
+#include <string>
+#include <sched.h>
+#include <pthread.h>
+#include <vector>
 #include <logger.h>
+#include "thread_pool.h"
 
-
-class ThreadPool final
+namespace
 {
 
-public:
-	enum class priority_t { MINOR, LOW, MEDIUM, HIGH, CRITICAL };
-
-	explicit ThreadPool(std::size_t capacity)
-		: m_capacity(capacity)
-		, m_stopped(true)
-	{
-		if (capacity > std::thread::hardware_concurrency())
-			Logger::logf(Logger::WARNING, __FILE__, __LINE__, "Requested threads count is %d while recommended count is %d. This may result in slow operation or unexpected termination of program.",
-				m_capacity, std::thread::hardware_concurrency());
-	}
-
-	~ThreadPool(void)
-	{
-		this->stop();
-	}
-
-	ThreadPool(ThreadPool&&) = delete;
-	ThreadPool(ThreadPool const&) = delete;
-	ThreadPool& operator=(ThreadPool&&) = delete;
-	ThreadPool& operator=(ThreadPool const&) = delete;
-
-
-        template<class T, class ...FuncArgs, class ...Args>
-        std::optional<std::future<typename std::function<T(FuncArgs...)>::result_type>>
-                prepare_task(std::function<T(FuncArgs...)> task, priority_t priority, Args &&... args)
-        {
-                if constexpr (false == std::is_void<T>::value)
-                {
-                        using RetType = typename decltype(task)::result_type;
-                        auto promise = std::make_shared<std::promise<RetType> >();
-                        std::future<RetType> future = promise->get_future();
-
-                        this->prepare_task_internal
-                        (
-                                [task, promise, args...]()
-                                {
-                                        try
-                                        {
-						promise->set_value(task(args...));
-                                        }
-                                        catch (std::exception const& e)
-                                        {
-                                                try{ promise->set_exception(std::current_exception()); }
-                                                catch (...)
-                                                {
-                                                        Logger::logf(Logger::ERROR, __FILE__, __LINE__, "%s", e.what());
-                                                }
-                                        }
-
-                                }, priority
-                        );
-                        return future;
-                }
-                else
-                {
-                        this->prepare_task_internal
-                        (
-                                [task, args...]()
-                                {
-                                        try
-                                        {
-                                                task(args...);
-                                        }
-                                        catch (const std::exception& e)
-                                        {
-                                                Logger::logf(Logger::ERROR, __FILE__, __LINE__, "%s", e.what());
-                                        }
-                                }, priority
-                        );
-                        return std::nullopt;
-                }
-        }
-
-	void start(void)
-	{
-		try 
-		{
-			this->m_stopped = false;
-			this->start_internal();
-		}
-		catch (std::exception const& e)
-		{
-			Logger::logf(Logger::ERROR, __FILE__, __LINE__, "Error occurred in ThreadPool::start(): %s", e.what());
-			this->stop();
-		}
-		catch (...)
-		{
-			Logger::logf(Logger::ERROR, __FILE__, __LINE__, "Unexpected error occurred in ThreadPool::start()");
-			this->stop();
-		}
-	}
-
-	void stop(void)
-	{
-		try
-		{
-			if (true == this->m_stopped) return;
-			this->m_stop_requested.store(true, std::memory_order_release);
-			m_cv.notify_all();
-			for (auto& thread : m_threads)
-				if(thread.joinable()) thread.join();
-			this->m_stopped = true;
-		}
-		catch (std::exception const& e)
-                {
-                        Logger::logf(Logger::ERROR, __FILE__, __LINE__, "Error occurred in ThreadPool::stop(): %s", e.what());
-			std::terminate();
-                }
-                catch (...)
-                {
-                        Logger::logf(Logger::ERROR, __FILE__, __LINE__, "Unexpected error occurred in ThreadPool::stop()");
-                        std::terminate();
-                }
-	}
-private:
-
-	void start_internal(void)
-	{
-		m_threads.reserve(m_capacity);
-		for (size_t i = 0; i < m_capacity; i++)
-		{
-			m_threads.emplace_back([this]()
-				{
-					while (false == this->m_stop_requested.load())
-					{
-						Task task;
-						{
-							std::unique_lock<std::mutex> ul(m_mutex);
-							m_cv.wait(ul,
-								[this, &task] ()
-								{
-									if (true == m_stop_requested.load(std::memory_order_acquire))
-										return true;
-									if (false == m_queue.empty())
-										return task = m_queue.top(), m_queue.pop(), true;
-									return false;
-								}
-
-							);
-						}
-						task();
-					}
-				});
-		}
-	}
-
-	template<class T>
-	void prepare_task_internal(T const& task, ThreadPool::priority_t priority)
-	{
-		{
-			std::lock_guard<std::mutex> lg(m_mutex);
-			m_queue.emplace(std::function<void()>(task), priority);
-		}
-		m_cv.notify_one();
-	}
-	
+ThreadPool::CoTask<int> co_square(ThreadPool& tp, int x)
+{
+	co_await tp.schedule(ThreadPool::priority_t::HIGH);
+	co_return x * x;
+}
 
-	struct Task
-	{
-		std::function<void()> m_task;
-		priority_t m_priority;
-		bool operator<(Task const& task) const noexcept
-		{
-			return this->m_priority < task.m_priority;
-		}
-		void operator()() const
-		{
-			if(m_task)
-				m_task();
-		}
-		Task(std::function<void()> task, priority_t priority)
-			: m_task(std::move(task))
-			, m_priority(priority)
-		{
+// Awaits other coroutines and a Future without holding a worker meanwhile.
+ThreadPool::CoTask<int> co_sum_of_squares(ThreadPool& tp, int count)
+{
+	int res = 0;
+	for (int i = 1; i <= count; ++i)
+		res += co_await co_square(tp, i);
+	res += co_await tp.submit([](int x) { return x; }, ThreadPool::priority_t::LOW, 0);
+	co_return res;
+}
 
-		}
-		Task()
-			: m_priority(ThreadPool::priority_t::MINOR)
-		{}
-	};
-	std::priority_queue<Task> m_queue;
-	std::vector<std::thread> m_threads;
-	std::mutex m_mutex;
-	std::atomic_bool m_stop_requested;
-	std::condition_variable m_cv;
-	std::size_t m_capacity;
-	bool m_stopped;
-};
+}
 
 
 int main(int, char**)
 {
 	Logger logger(nullptr, true, false);
+	Logger::enable_flight_recorder();
+	Logger::install_crash_handler(nullptr);
 	using namespace std::chrono_literals;
 	ThreadPool tp(5);
 	tp.start();
 	int x, y;
 	std::cin >> x >> y;
 	{
-		Logger::logf(Logger::INFO, __FILE__, __LINE__, "Tests with return type started");
+		LOGF(Logger::INFO, "Tests with return type started");
 		/*============== TEST WITH RETURN TYPE ==============*/
 		std::function<int(int, int)> fmul = [](int x, int y) {
 			return x * y;
@@ -236,19 +66,19 @@ int main(int, char**)
 
 		try
 		{
-			Logger::logf(Logger::INFO, __FILE__, __LINE__, "%d * %d \t=\t%d", x, y, future_mul->get());
-			Logger::logf(Logger::INFO, __FILE__, __LINE__, "%d / %d \t=\t%d", x, y, future_div->get());
-			Logger::logf(Logger::INFO, __FILE__, __LINE__, "%d - %d \t=\t%d", x, y, future_sub->get());
-			Logger::logf(Logger::INFO, __FILE__, __LINE__, "%d + %d \t=\t%d", x, y, future_sum->get());
+			LOGF(Logger::INFO, "%d * %d \t=\t%d", x, y, future_mul->get());
+			LOGF(Logger::INFO, "%d / %d \t=\t%d", x, y, future_div->get());
+			LOGF(Logger::INFO, "%d - %d \t=\t%d", x, y, future_sub->get());
+			LOGF(Logger::INFO, "%d + %d \t=\t%d", x, y, future_sum->get());
 		}
 		catch (std::exception const& e)
 		{
-			Logger::logf(Logger::ERROR, __FILE__, __LINE__, "Error occurred when trying to access returned values: %s", e.what());
+			LOGF(Logger::ERROR, "Error occurred when trying to access returned values: %s", e.what());
 			return 1;
 		}
 		catch (...)
 		{
-			Logger::logf(Logger::ERROR, __FILE__, __LINE__, "Unexpected error occurred when trying to access returned values");
+			LOGF(Logger::ERROR, "Unexpected error occurred when trying to access returned values");
 			return 1;
 		}
 	}
@@ -258,23 +88,23 @@ int main(int, char**)
 	/*============== TEST WITHOUT RETURN TYPE ==============*/
 	{
 
-		Logger::logf(Logger::INFO, __FILE__, __LINE__, "Tests without return type started");
+		LOGF(Logger::INFO, "Tests without return type started");
 
 		std::function<void(std::reference_wrapper<int>, std::reference_wrapper<int>)> fchg = [](std::reference_wrapper<int> x, std::reference_wrapper<int> y) {
 			x.get() <<= 1;
 			y.get() <<= 1;
 		};
 		std::function<void(int, int)> fmul = [](int x, int y) {
-			Logger::logf(Logger::INFO, __FILE__, __LINE__, "%d * %d \t=\t%d", x, y, x * y);
+			LOGF(Logger::INFO, "%d * %d \t=\t%d", x, y, x * y);
 		};
 		std::function<void(int, int)> fdiv = [](int x, int y) {
-			Logger::logf(Logger::INFO, __FILE__, __LINE__, "%d / %d \t=\t%d", x, y, x / y);
+			LOGF(Logger::INFO, "%d / %d \t=\t%d", x, y, x / y);
 		};
 		std::function<void(int, int)> fsub = [](int x, int y) {
-			Logger::logf(Logger::INFO, __FILE__, __LINE__, "%d - %d \t=\t%d", x, y, x - y);
+			LOGF(Logger::INFO, "%d - %d \t=\t%d", x, y, x - y);
 		};
 		std::function<void(int, int)> fsum = [](int x, int y) {
-			Logger::logf(Logger::INFO, __FILE__, __LINE__, "%d + %d \t=\t%d", x, y, x + y);
+			LOGF(Logger::INFO, "%d + %d \t=\t%d", x, y, x + y);
 		};
 
 		auto future_chg = tp.prepare_task(fchg, ThreadPool::priority_t::CRITICAL, std::ref(x), std::ref(y));
@@ -288,12 +118,316 @@ int main(int, char**)
 			|| future_sub.has_value()
 			|| future_sum.has_value())
 		{
-			Logger::logf(Logger::FATAL, __FILE__, __LINE__, "Objects returned are expected to not contain values");
+			LOGF(Logger::FATAL, "Objects returned are expected to not contain values");
 			return 1;
 		}
 		std::this_thread::sleep_for(1000ms);
 	}
 
+	/*============== TEST WITH NESTED TASKS ==============*/
+	{
+		LOGF(Logger::INFO, "Tests with nested tasks started");
+
+		// Tasks submitted from a worker go to its own deque, and idle
+		// workers steal them.
+		std::function<int(int)> fsquare = [](int x) {
+			return x * x;
+		};
+		std::function<std::vector<std::future<int>>(int)> fspawn = [&tp, fsquare](int count) {
+			std::vector<std::future<int>> res;
+			for (int i = 1; i <= count; ++i)
+				res.push_back(std::move(*tp.prepare_task(fsquare, ThreadPool::priority_t::HIGH, i)));
+			return res;
+		};
+
+		static constexpr int count = 100;
+		auto future_spawn = tp.prepare_task(fspawn, ThreadPool::priority_t::MEDIUM, count);
+		int sum = 0;
+		for (auto& future : future_spawn->get())
+			sum += future.get();
+		LOGF(Logger::INFO, "sum of squares up to %d \t=\t%d", count, sum);
+		if (count * (count + 1) * (2 * count + 1) / 6 != sum)
+		{
+			LOGF(Logger::FATAL, "Nested tasks returned a wrong sum");
+			return 1;
+		}
+	}
+
+	/*============== TEST WITH BULK SUBMISSION ==============*/
+	{
+		LOGF(Logger::INFO, "Tests with bulk submission started");
+
+		static constexpr int count = 1000;
+		std::vector<int> values(count);
+		for (int i = 0; i < count; ++i)
+			values[i] = i + 1;
+
+		std::atomic<long> bulk_sum = 0;
+		tp.submit_bulk(values, [&bulk_sum](int value) { bulk_sum += value; }, ThreadPool::priority_t::HIGH).get();
+
+		std::vector<long> squares(count);
+		tp.parallel_for(0, count, 64, [&squares](int i) { squares[i] = static_cast<long>(i + 1) * (i + 1); }).get();
+
+		long reduce_sum = tp.parallel_reduce(0, count, 0, 0L,
+			[&squares](int i) { return squares[i]; },
+			[](long x, long y) { return x + y; }).get();
+
+		LOGF(Logger::INFO, "submit_bulk sum up to %d \t=\t%ld", count, bulk_sum.load());
+		LOGF(Logger::INFO, "parallel_reduce sum of squares up to %d \t=\t%ld", count, reduce_sum);
+		if (static_cast<long>(count) * (count + 1) / 2 != bulk_sum.load()
+			|| static_cast<long>(count) * (count + 1) * (2 * count + 1) / 6 != reduce_sum)
+		{
+			LOGF(Logger::FATAL, "Bulk submission returned a wrong sum");
+			return 1;
+		}
+	}
+
+	/*============== TEST WITH CONTINUATIONS ==============*/
+	{
+		LOGF(Logger::INFO, "Tests with continuations started");
+
+		auto future_chain = tp.submit([](int x) { return x + 1; }, ThreadPool::priority_t::MEDIUM, 1)
+			.then([](int x) { return x * 10; })
+			.then([](int x) { return x - 5; });
+
+		std::vector<ThreadPool::Future<int>> futures;
+		for (int i = 1; i <= 4; ++i)
+			futures.push_back(tp.submit([](int x) { return x * x; }, ThreadPool::priority_t::HIGH, i));
+		auto future_any = tp.when_any(futures);
+		auto future_all = tp.when_all(std::move(futures));
+
+		ThreadPool::TaskGraph graph;
+		std::atomic<int> graph_order = 0;
+		int first = 0, second = 0, last = 0;
+		auto a = graph.add([&]() { first = ++graph_order; });
+		auto b = graph.add([&]() { second = ++graph_order; });
+		auto c = graph.add([&]() { last = ++graph_order; });
+		graph.precede(a, c);
+		graph.precede(b, c);
+
+		try
+		{
+			graph.run(tp).get();
+			int all = 0;
+			for (int value : future_all.get())
+				all += value;
+			std::size_t any = future_any.get();
+			LOGF(Logger::INFO, "(1 + 1) * 10 - 5 \t=\t%d", future_chain.get());
+			LOGF(Logger::INFO, "1 + 4 + 9 + 16 \t=\t%d, first ready: %zu", all, any);
+			LOGF(Logger::INFO, "position of the joining graph node \t=\t%d", last);
+			if (15 != future_chain.get() || 30 != all || any >= 4 || 3 != last || 0 == first || 0 == second)
+			{
+				LOGF(Logger::FATAL, "Continuations returned wrong results");
+				return 1;
+			}
+		}
+		catch (std::exception const& e)
+		{
+			LOGF(Logger::ERROR, "Error occurred when trying to access continued values: %s", e.what());
+			return 1;
+		}
+	}
+
+	/*============== TEST WITH COROUTINES ==============*/
+	{
+		LOGF(Logger::INFO, "Tests with coroutines started");
+
+		static constexpr int count = 10;
+		try
+		{
+			int sum = tp.spawn(co_sum_of_squares(tp, count)).get();
+			LOGF(Logger::INFO, "coroutine sum of squares up to %d \t=\t%d", count, sum);
+			if (count * (count + 1) * (2 * count + 1) / 6 != sum)
+			{
+				LOGF(Logger::FATAL, "Coroutines returned a wrong sum");
+				return 1;
+			}
+		}
+		catch (std::exception const& e)
+		{
+			LOGF(Logger::ERROR, "Error occurred when trying to access the coroutine result: %s", e.what());
+			return 1;
+		}
+	}
+
+	/*============== TEST WITH PINNED WORKERS ==============*/
+	{
+		LOGF(Logger::INFO, "Tests with pinned workers started");
+
+		// Under CORES placement every worker may only run on one CPU.
+		ThreadPool pinned(2, ThreadPool::placement_t::CORES);
+		pinned.start();
+		std::atomic<int> unpinned = 0;
+		pinned.parallel_for(0, 64, 1, [&unpinned](int) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			if (0 != pthread_getaffinity_np(pthread_self(), sizeof(set), &set) || 1 != CPU_COUNT(&set))
+				++unpinned;
+		}).get();
+		LOGF(Logger::INFO, "calls on a worker allowed more than one CPU \t=\t%d", unpinned.load());
+		if (0 != unpinned.load())
+		{
+			LOGF(Logger::FATAL, "Pinned workers are expected to run on a single CPU");
+			return 1;
+		}
+	}
+
+	/*============== TEST WITH RESIZING ==============*/
+	{
+		LOGF(Logger::INFO, "Tests with resizing started");
+
+		ThreadPool elastic(1);
+		elastic.start();
+		elastic.resize(3);
+		std::size_t resized = elastic.size();
+
+		// Tasks queued while the pool is stopped run once it starts again.
+		elastic.stop();
+		std::atomic<int> done = 0;
+		std::vector<ThreadPool::Future<void>> futures;
+		for (int i = 0; i < 8; ++i)
+			futures.push_back(elastic.submit([&done]() { ++done; }, ThreadPool::priority_t::MEDIUM));
+		int before_start = done.load();
+		elastic.start();
+		elastic.when_all(std::move(futures)).get();
+
+		// Sleeping tasks stall the queue, so the supervisor adds workers,
+		// and retires them once they have been idle for the timeout.
+		elastic.resize(1);
+		elastic.enable_elastic(1, 4, 200us, std::chrono::milliseconds(20));
+		std::size_t grown = 1;
+		std::vector<ThreadPool::Future<void>> sleepers;
+		for (int i = 0; i < 16; ++i)
+			sleepers.push_back(elastic.submit([]() { std::this_thread::sleep_for(2ms); }, ThreadPool::priority_t::MEDIUM));
+		auto all_slept = elastic.when_all(std::move(sleepers));
+		while (false == all_slept.is_ready())
+		{
+			grown = std::max(grown, elastic.size());
+			std::this_thread::sleep_for(1ms);
+		}
+		for (int i = 0; i < 200 && elastic.size() > 1; ++i)
+			std::this_thread::sleep_for(10ms);
+		std::size_t shrunk = elastic.size();
+		elastic.disable_elastic();
+
+		LOGF(Logger::INFO, "resized to %zu, ran %d task(s) while stopped and %d after restarting", resized, before_start, done.load());
+		LOGF(Logger::INFO, "elastic pool grew to %zu worker(s) and shrank back to %zu", grown, shrunk);
+		if (3 != resized || 0 != before_start || 8 != done.load() || grown < 2 || 1 != shrunk)
+		{
+			LOGF(Logger::FATAL, "Resizing did not behave as expected");
+			return 1;
+		}
+	}
+
+	/*============== TEST WITH SCHEDULING POLICIES ==============*/
+	{
+		LOGF(Logger::INFO, "Tests with scheduling policies started");
+
+		// A single worker, held by a task until the others are queued, runs
+		// them in the order the policy picks.
+		ThreadPool single(1);
+		single.start();
+		std::mutex order_mutex;
+		std::vector<int> order;
+		auto record = [&order_mutex, &order](int id) {
+			std::lock_guard<std::mutex> lg(order_mutex);
+			order.push_back(id);
+		};
+		std::atomic<bool> release = false;
+		auto hold = [&release]() {
+			while (false == release.load())
+				std::this_thread::sleep_for(1ms);
+		};
+
+		// STRICT, the default: the highest priority first.
+		single.submit(hold, ThreadPool::priority_t::CRITICAL);
+		std::this_thread::sleep_for(10ms);
+		auto minor = single.submit(record, ThreadPool::priority_t::MINOR, 1);
+		auto critical = single.submit(record, ThreadPool::priority_t::CRITICAL, 2);
+		release = true;
+		minor.wait();
+		critical.wait();
+		std::vector<int> strict_order = std::exchange(order, {});
+
+		// EDF: the earliest deadline first, whatever the priority.
+		single.set_policy(ThreadPool::policy_t::EDF);
+		release = false;
+		single.submit(hold, ThreadPool::priority_t::CRITICAL);
+		std::this_thread::sleep_for(10ms);
+		auto now = std::chrono::steady_clock::now();
+		auto late = single.submit_before(now + 1s, record, ThreadPool::priority_t::CRITICAL, 1);
+		auto early = single.submit_before(now + 1ms, record, ThreadPool::priority_t::MINOR, 2);
+		release = true;
+		late.wait();
+		early.wait();
+		std::vector<int> edf_order = std::exchange(order, {});
+		single.set_policy(ThreadPool::policy_t::STRICT);
+
+		// Tasks left in a deque by stop() run in submission order on restart.
+		release = false;
+		single.submit([&]() {
+			for (int i = 1; i <= 4; ++i)
+				single.submit(record, ThreadPool::priority_t::MEDIUM, i);
+			hold();
+			std::this_thread::sleep_for(50ms);
+		}, ThreadPool::priority_t::MEDIUM);
+		std::this_thread::sleep_for(10ms);
+		release = true;
+		single.stop();
+		single.start();
+		std::vector<int> reclaimed_order;
+		for (int i = 0; i < 1000 && reclaimed_order.size() < 4; ++i)
+		{
+			std::this_thread::sleep_for(1ms);
+			std::lock_guard<std::mutex> lg(order_mutex);
+			reclaimed_order = order;
+		}
+
+		LOGF(Logger::INFO, "STRICT ran task %d first, EDF ran task %d first", strict_order.at(0), edf_order.at(0));
+		LOGF(Logger::INFO, "reclaimed tasks ran in order %d %d %d %d", reclaimed_order.at(0), reclaimed_order.at(1), reclaimed_order.at(2), reclaimed_order.at(3));
+		if (std::vector<int>{ 2, 1 } != strict_order || std::vector<int>{ 2, 1 } != edf_order || std::vector<int>{ 1, 2, 3, 4 } != reclaimed_order)
+		{
+			LOGF(Logger::FATAL, "Tasks did not run in the order of the policy");
+			return 1;
+		}
+	}
+
+	/*============== TEST WITH METRICS AND TRACING ==============*/
+	{
+		LOGF(Logger::INFO, "Tests with metrics and tracing started");
+
+		static constexpr int count = 64;
+		ThreadPool::Metrics before = tp.metrics();
+		tp.enable_metrics();
+		tp.enable_tracing();
+		tp.parallel_for(0, count, 1, [](int) { std::this_thread::sleep_for(100us); }, ThreadPool::priority_t::LOW).get();
+		tp.enable_tracing(false);
+		tp.enable_metrics(false);
+		ThreadPool::Metrics after = tp.metrics();
+
+		std::uint64_t tasks = 0;
+		for (std::size_t i = 0; i < after.m_workers.size(); ++i)
+			tasks += after.m_workers[i].m_tasks - (i < before.m_workers.size() ? before.m_workers[i].m_tasks : 0);
+		auto const low = static_cast<std::size_t>(ThreadPool::priority_t::LOW);
+		std::uint64_t timed = after.m_run[low].count() - before.m_run[low].count();
+
+		std::ostringstream trace;
+		tp.write_trace(trace);
+		std::string json = trace.str();
+		std::size_t spans = 0;
+		for (std::size_t pos = 0; std::string::npos != (pos = json.find("\"ph\":\"X\"", pos)); ++pos)
+			++spans;
+
+		LOGF(Logger::INFO, "tasks run \t=\t%llu, LOW tasks timed \t=\t%llu, p99 run time %llu ns",
+			static_cast<unsigned long long>(tasks), static_cast<unsigned long long>(timed), static_cast<unsigned long long>(after.m_run[low].quantile(0.99)));
+		LOGF(Logger::INFO, "trace spans \t=\t%zu", spans);
+		if (tasks < count || timed < count || spans < count || 0 != json.rfind("{\"traceEvents\":[", 0))
+		{
+			LOGF(Logger::FATAL, "Metrics or trace do not account for the tasks run");
+			return 1;
+		}
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,2712 @@
+#pragma once
+
+#include <thread>
+#include <future>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <functional>
+#include <coroutine>
+#include <iterator>
+#include <exception>
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+#include <latch>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <fstream>
+#include <ostream>
+#include <cstdio>
+#include <filesystem>
+#include <sched.h>
+#include <pthread.h>
+#include <logger.h>
+
+
+// Work-stealing pool: every worker owns one Chase-Lev deque per priority.
+// Tasks submitted from a worker go to its own deque; other submissions go
+// through a lock-free injection stack that idle workers take over in one
+// exchange. Workers always look for the highest pending priority first,
+// stealing from a random victim when their own deque is empty.
+//
+// Workers can be pinned to CPUs. They are then spread over the NUMA nodes,
+// each node getting its own injection stack, fed by the threads running on
+// it; workers steal from their own node before crossing to another one.
+class ThreadPool final
+{
+
+public:
+	enum class priority_t { MINOR, LOW, MEDIUM, HIGH, CRITICAL };
+
+	// NONE leaves workers to the scheduler, CORES pins each of them to one
+	// CPU, and NODES to all the CPUs of its NUMA node.
+	enum class placement_t { NONE, CORES, NODES };
+
+	// Each worker deque and each injection queue is FIFO per priority, but
+	// there is no global order: with several workers, tasks of one priority
+	// may start out of submission order. STRICT runs the highest pending
+	// priority first. WEIGHTED shares the workers among the pending
+	// priorities in proportion to weights 1, 2, 4, 8 and 16, MINOR to
+	// CRITICAL, so that no priority starves. EDF runs the task with the
+	// earliest deadline first, a task without one being due at its
+	// submission time plus the budget of its priority. STRICT is the
+	// default; the others are opted into with set_policy().
+	enum class policy_t { STRICT, WEIGHTED, EDF };
+
+	// HDR histogram of durations in nanoseconds: 16 linear sub-buckets per
+	// power of two, so that values are known within 1/16, up to 2^44 ns.
+	struct Histogram
+	{
+		static constexpr std::size_t sub_buckets = 16;
+		static constexpr std::size_t bucket_count = sub_buckets * 41;
+
+		std::vector<std::uint64_t> m_counts;
+
+		Histogram(void)
+			: m_counts(bucket_count, 0)
+		{
+		}
+
+		static std::size_t bucket(std::uint64_t value)
+		{
+			if (value < sub_buckets)
+				return value;
+			std::size_t exponent = std::bit_width(value) - 1;
+			if (exponent >= 44)
+				return bucket_count - 1;
+			return sub_buckets * (exponent - 3) + (value >> (exponent - 4)) - sub_buckets;
+		}
+
+		static std::uint64_t lower_bound(std::size_t bucket)
+		{
+			if (bucket < sub_buckets)
+				return bucket;
+			std::size_t exponent = bucket / sub_buckets + 3;
+			return (sub_buckets + bucket % sub_buckets) << (exponent - 4);
+		}
+
+		Histogram& operator+=(Histogram const& other)
+		{
+			for (std::size_t i = 0; i < bucket_count; ++i)
+				m_counts[i] += other.m_counts[i];
+			return *this;
+		}
+
+		std::uint64_t count(void) const
+		{
+			std::uint64_t res = 0;
+			for (std::uint64_t count : m_counts)
+				res += count;
+			return res;
+		}
+
+		// Upper bound of the given fraction of the values.
+		std::uint64_t quantile(double fraction) const
+		{
+			std::uint64_t total = this->count();
+			std::uint64_t seen = 0;
+			for (std::size_t i = 0; i < bucket_count; ++i)
+			{
+				seen += m_counts[i];
+				if (0 != seen && static_cast<double>(seen) >= fraction * static_cast<double>(total))
+					return i + 1 < bucket_count ? lower_bound(i + 1) - 1 : UINT64_MAX;
+			}
+			return 0;
+		}
+
+		double mean(void) const
+		{
+			double sum = 0;
+			std::uint64_t total = 0;
+			for (std::size_t i = 0; i + 1 < bucket_count; ++i)
+			{
+				sum += static_cast<double>(m_counts[i]) * static_cast<double>(lower_bound(i) + lower_bound(i + 1)) / 2;
+				total += m_counts[i];
+			}
+			return 0 == total ? 0 : sum / static_cast<double>(total);
+		}
+	};
+
+	struct WorkerMetrics
+	{
+		std::uint64_t m_tasks = 0;
+		std::uint64_t m_steal_attempts = 0;
+		std::uint64_t m_steals = 0;
+		// time spent running tasks, and looking for or waiting for one
+		std::uint64_t m_busy_ns = 0;
+		std::uint64_t m_idle_ns = 0;
+	};
+
+	// Snapshot returned by metrics(). Per worker slot counters, and queue
+	// wait and run time histograms indexed by priority; times are only
+	// measured while metrics are enabled.
+	struct Metrics
+	{
+		std::vector<WorkerMetrics> m_workers;
+		std::int64_t m_queued[5] = {};
+		Histogram m_wait[5];
+		Histogram m_run[5];
+	};
+
+	explicit ThreadPool(std::size_t capacity, placement_t placement = placement_t::NONE)
+		: m_pending{}
+		, m_sleepers(0)
+		, m_wake_epoch(0)
+		, m_stop_requested(false)
+		, m_capacity(0 == capacity ? 1 : capacity)
+		, m_stopped(true)
+		, m_placement(placement)
+		, m_node_count(1)
+		, m_table(nullptr)
+		, m_table_size(0)
+		, m_active(0)
+		, m_elastic(false)
+		, m_overloaded(false)
+		, m_latency_ns(0)
+		, m_min_capacity(1)
+		, m_max_capacity(1)
+		, m_idle_timeout(0)
+		, m_supervisor_stop(false)
+		, m_policy(policy_t::STRICT)
+		, m_metrics(false)
+		, m_tracing(false)
+		, m_budgets{ 1000000000, 100000000, 10000000, 1000000, 100000 }
+		, m_trace_origin(0)
+	{
+		if (capacity > std::thread::hardware_concurrency())
+			LOGF(Logger::WARNING, "Requested threads count is %zu while recommended count is %u. This may result in slow operation or unexpected termination of program.",
+				m_capacity.load(), std::thread::hardware_concurrency());
+		if (placement_t::NONE != m_placement)
+		{
+			m_topology = numa_topology();
+			m_node_count = std::min(m_topology.size(), m_capacity.load());
+			for (std::size_t node = 0; node < m_topology.size(); ++node)
+			{
+				for (int cpu : m_topology[node])
+				{
+					if (static_cast<std::size_t>(cpu) >= m_cpu_node.size())
+						m_cpu_node.resize(cpu + 1, 0);
+					m_cpu_node[cpu] = node % m_node_count;
+				}
+			}
+		}
+		m_nodes.reset(new Node[m_node_count]);
+	}
+
+	~ThreadPool(void)
+	{
+		this->stop();
+		// Dropping a task may break a Future, which enqueues its continuations.
+		for (bool dropped = true; true == dropped; )
+		{
+			dropped = false;
+			while (TaskNode* node = this->take_deadline())
+			{
+				dropped = true;
+				free_node(node);
+			}
+			for (std::size_t i = 0; i < m_node_count; ++i)
+			{
+				while (TaskNode* node = m_nodes[i].m_injected.exchange(nullptr, std::memory_order_acquire))
+				{
+					dropped = true;
+					while (nullptr != node)
+					{
+						TaskNode* next = node->m_next;
+						free_node(node);
+						node = next;
+					}
+				}
+			}
+		}
+	}
+
+	ThreadPool(ThreadPool&&) = delete;
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool&&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+
+
+        template<class T, class ...FuncArgs, class ...Args>
+        std::optional<std::future<typename std::function<T(FuncArgs...)>::result_type>>
+                prepare_task(std::function<T(FuncArgs...)> task, priority_t priority, Args &&... args)
+        {
+                if constexpr (false == std::is_void<T>::value)
+                {
+                        using RetType = typename decltype(task)::result_type;
+                        std::promise<RetType> promise(std::allocator_arg, PoolAllocator<RetType>());
+                        std::future<RetType> future = promise.get_future();
+
+                        this->prepare_task_internal
+                        (
+                                [task = std::move(task), promise = std::move(promise), args = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)]() mutable
+                                {
+                                        try
+                                        {
+						promise.set_value(std::apply(task, std::move(args)));
+                                        }
+                                        catch (std::exception const& e)
+                                        {
+                                                try{ promise.set_exception(std::current_exception()); }
+                                                catch (...)
+                                                {
+                                                        LOGF(Logger::ERROR, "%s", e.what());
+                                                }
+                                        }
+
+                                }, priority
+                        );
+                        return future;
+                }
+                else
+                {
+                        this->prepare_task_internal
+                        (
+                                [task = std::move(task), args = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)]() mutable
+                                {
+                                        try
+                                        {
+                                                std::apply(task, std::move(args));
+                                        }
+                                        catch (const std::exception& e)
+                                        {
+                                                LOGF(Logger::ERROR, "%s", e.what());
+                                        }
+                                }, priority
+                        );
+                        return std::nullopt;
+                }
+        }
+
+	// Runs fn(item) for every item of range, in chunks of about four per
+	// worker enqueued in one operation. A random-access range passed as an
+	// lvalue is read in place, and must outlive the future; any other range
+	// is first moved or copied into the shared state. The future is ready
+	// once every call returned, and holds the first exception thrown by fn,
+	// if any.
+	template<class Range, class F>
+	std::future<void> submit_bulk(Range&& range, F fn, priority_t priority = priority_t::MEDIUM)
+	{
+		using It = decltype(std::begin(range));
+		if constexpr (std::is_lvalue_reference_v<Range> && std::random_access_iterator<It>)
+		{
+			It first = std::begin(range);
+			std::size_t size = static_cast<std::size_t>(std::end(range) - first);
+			return this->submit_items(size, [first](std::size_t i) -> decltype(auto) { return first[i]; }, std::move(fn), priority);
+		}
+		else
+		{
+			using Item = std::decay_t<decltype(*std::begin(range))>;
+			std::vector<Item> items;
+			if constexpr (std::is_lvalue_reference_v<Range>)
+				items.assign(std::begin(range), std::end(range));
+			else
+				items.assign(std::make_move_iterator(std::begin(range)), std::make_move_iterator(std::end(range)));
+			std::size_t size = items.size();
+			return this->submit_items(size, [items = std::move(items)](std::size_t i) mutable -> Item& { return items[i]; }, std::move(fn), priority);
+		}
+	}
+
+	// Runs fn(i) for i in [begin, end), in chunks of grain indices; a zero
+	// grain splits the range in about four chunks per worker.
+	template<class Index, class F>
+	std::future<void> parallel_for(Index begin, Index end, std::size_t grain, F fn, priority_t priority = priority_t::MEDIUM)
+	{
+		static_assert(std::is_integral_v<Index>, "parallel_for() expects integral indices");
+		std::size_t size = end > begin ? static_cast<std::size_t>(end - begin) : 0;
+		grain = this->grain_for(size, grain);
+		auto run = [fn = std::move(fn), begin, end, grain](std::size_t chunk) mutable
+		{
+			Index first = begin + static_cast<Index>(chunk * grain);
+			Index last = static_cast<std::size_t>(end - first) > grain ? first + static_cast<Index>(grain) : end;
+			for (Index i = first; i < last; ++i)
+				fn(i);
+		};
+		return this->submit_chunks<void>((size + grain - 1) / grain, std::move(run), [](){}, priority);
+	}
+
+	// Folds reduce(..., map(i)) over [begin, end), starting every chunk from
+	// identity. The chunk results are combined in index order, so reduce only
+	// needs to be associative.
+	template<class Index, class T, class Map, class Reduce>
+	std::future<T> parallel_reduce(Index begin, Index end, std::size_t grain, T identity, Map map, Reduce reduce, priority_t priority = priority_t::MEDIUM)
+	{
+		static_assert(std::is_integral_v<Index>, "parallel_reduce() expects integral indices");
+		std::size_t size = end > begin ? static_cast<std::size_t>(end - begin) : 0;
+		grain = this->grain_for(size, grain);
+		std::size_t chunks = (size + grain - 1) / grain;
+		auto partials = std::make_shared<std::vector<T>>(chunks, identity);
+		auto run = [map = std::move(map), reduce, partials, identity, begin, end, grain](std::size_t chunk) mutable
+		{
+			Index first = begin + static_cast<Index>(chunk * grain);
+			Index last = static_cast<std::size_t>(end - first) > grain ? first + static_cast<Index>(grain) : end;
+			T acc = identity;
+			for (Index i = first; i < last; ++i)
+				acc = reduce(std::move(acc), map(i));
+			(*partials)[chunk] = std::move(acc);
+		};
+		auto complete = [reduce, partials, identity]() mutable
+		{
+			T res = identity;
+			for (T& partial : *partials)
+				res = reduce(std::move(res), std::move(partial));
+			return res;
+		};
+		return this->submit_chunks<T>(chunks, std::move(run), std::move(complete), priority);
+	}
+
+	// Can be called again after stop(), with the tasks queued meanwhile.
+	void start(void)
+	{
+		try
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (false == this->m_stopped) return;
+			this->m_stop_requested.store(false, std::memory_order_relaxed);
+			this->m_stopped = false;
+			this->launch_workers();
+			this->start_supervisor();
+		}
+		catch (std::exception const& e)
+		{
+			LOGF(Logger::ERROR, "Error occurred in ThreadPool::start(): %s", e.what());
+			this->stop();
+		}
+		catch (...)
+		{
+			LOGF(Logger::ERROR, "Unexpected error occurred in ThreadPool::start()");
+			this->stop();
+		}
+	}
+
+	// Tasks still queued are kept, and run if the pool is started again.
+	void stop(void)
+	{
+		try
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (true == this->m_stopped) return;
+			this->m_stop_requested.store(true, std::memory_order_release);
+			this->stop_supervisor(lock);
+			this->wake_all();
+			for (auto& thread : m_threads)
+				if(thread.joinable()) thread.join();
+			this->reclaim_tasks();
+			std::int64_t now = clock_ns();
+			for (auto const& worker : m_workers)
+			{
+				worker->add_metrics(m_retired, now);
+				worker->move_spans(m_retired_spans);
+			}
+			m_threads.clear();
+			m_table.store(nullptr, std::memory_order_relaxed);
+			m_table_size.store(0, std::memory_order_relaxed);
+			m_tables.clear();
+			m_workers.clear();
+			m_active.store(0, std::memory_order_relaxed);
+			this->m_stopped = true;
+		}
+		catch (std::exception const& e)
+                {
+                        LOGF(Logger::ERROR, "Error occurred in ThreadPool::stop(): %s", e.what());
+			std::terminate();
+                }
+                catch (...)
+                {
+                        LOGF(Logger::ERROR, "Unexpected error occurred in ThreadPool::stop()");
+                        std::terminate();
+                }
+	}
+
+	// Changes the number of workers while the pool runs. Surplus workers
+	// retire once done with their current task, handing their queued tasks
+	// over to the others.
+	void resize(std::size_t capacity)
+	{
+		try
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_capacity.store(0 == capacity ? 1 : capacity, std::memory_order_relaxed);
+			if (true == this->m_stopped) return;
+			this->launch_workers();
+			this->wake_all();
+		}
+		catch (std::exception const& e)
+		{
+			LOGF(Logger::ERROR, "Error occurred in ThreadPool::resize(): %s", e.what());
+		}
+	}
+
+	std::size_t size(void) const
+	{
+		return m_capacity.load(std::memory_order_relaxed);
+	}
+
+	// Elastic mode: a supervisor thread adds a worker, up to max_capacity,
+	// whenever a task waited more than latency to start, and retires one,
+	// down to min_capacity, once workers have been idle for idle_timeout.
+	void enable_elastic(std::size_t min_capacity, std::size_t max_capacity, std::chrono::microseconds latency, std::chrono::milliseconds idle_timeout)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_min_capacity = std::max<std::size_t>(1, min_capacity);
+		m_max_capacity = std::max(m_min_capacity, max_capacity);
+		m_latency_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count(), std::memory_order_relaxed);
+		m_idle_timeout = idle_timeout;
+		m_capacity.store(std::clamp(m_capacity.load(std::memory_order_relaxed), m_min_capacity, m_max_capacity), std::memory_order_relaxed);
+		m_elastic.store(true, std::memory_order_relaxed);
+		if (true == this->m_stopped) return;
+		this->stop_supervisor(lock);
+		try
+		{
+			this->launch_workers();
+			this->wake_all();
+			this->start_supervisor();
+		}
+		catch (std::exception const& e)
+		{
+			LOGF(Logger::ERROR, "Error occurred in ThreadPool::enable_elastic(): %s", e.what());
+		}
+	}
+
+	// Keeps the current number of workers.
+	void disable_elastic(void)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_elastic.store(false, std::memory_order_relaxed);
+		this->stop_supervisor(lock);
+	}
+
+	void set_policy(policy_t policy)
+	{
+		m_policy.store(policy, std::memory_order_relaxed);
+	}
+
+	// Relative deadline given under EDF to the tasks submitted without one.
+	void set_deadline_budget(priority_t priority, std::chrono::nanoseconds budget)
+	{
+		m_budgets[static_cast<std::size_t>(priority)].store(budget.count(), std::memory_order_relaxed);
+	}
+
+	// Timings are only measured while enabled; counters always are.
+	void enable_metrics(bool enable = true)
+	{
+		m_metrics.store(enable, std::memory_order_relaxed);
+	}
+
+	// Aggregates the per-worker counters, without stopping them.
+	Metrics metrics(void) const
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		Metrics res = m_retired;
+		std::int64_t now = clock_ns();
+		for (auto const& worker : m_workers)
+			worker->add_metrics(res, now);
+		for (std::size_t priority = 0; priority < priority_count; ++priority)
+			res.m_queued[priority] = m_pending[priority].load(std::memory_order_relaxed);
+		return res;
+	}
+
+	// Records a span per task run, up to trace_capacity per worker, the
+	// oldest ones being overwritten. Enabling drops the spans recorded so
+	// far.
+	void enable_tracing(bool enable = true)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (true == enable)
+		{
+			m_retired_spans.clear();
+			for (auto& worker : m_workers)
+				worker->clear_spans();
+			m_trace_origin = clock_ns();
+		}
+		m_tracing.store(enable, std::memory_order_relaxed);
+	}
+
+	// Writes the recorded spans in the Chrome trace event format, which
+	// chrome://tracing and Perfetto load.
+	void write_trace(std::ostream& out) const
+	{
+		static char const* const names[] = { "MINOR", "LOW", "MEDIUM", "HIGH", "CRITICAL" };
+		std::unique_lock<std::mutex> lock(m_mutex);
+		std::vector<Span> spans = m_retired_spans;
+		for (auto const& worker : m_workers)
+			worker->copy_spans(spans);
+
+		char line[256];
+		out << "{\"traceEvents\":[";
+		bool first = true;
+		for (std::size_t i = 0; i < m_workers.size(); ++i)
+		{
+			std::snprintf(line, sizeof(line), "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"ThreadPool worker %zu\"}}",
+				true == first ? "" : ",", i, i);
+			out << line;
+			first = false;
+		}
+		for (Span const& span : spans)
+		{
+			std::snprintf(line, sizeof(line), "%s\n{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+				true == first ? "" : ",", names[span.m_priority], span.m_worker,
+				static_cast<double>(span.m_start - m_trace_origin) / 1000, static_cast<double>(span.m_duration) / 1000);
+			out << line;
+			first = false;
+		}
+		out << "\n]}\n";
+	}
+
+	static constexpr std::size_t trace_capacity = std::size_t(1) << 16;
+
+private:
+
+	static constexpr std::size_t priority_count = 5;
+
+	// Move-only type-erased callable. Callables of up to inline_capacity bytes
+	// that can be moved without throwing are stored in place; larger ones go
+	// to the heap.
+	class Task
+	{
+		static constexpr std::size_t inline_capacity = 96;
+
+		enum class op_t { INVOKE, MOVE, DESTROY };
+
+		using manager_t = void (*)(op_t, Task&, Task*);
+
+		template<class F>
+		static constexpr bool is_inline_v = sizeof(F) <= inline_capacity && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<F>;
+
+		alignas(std::max_align_t) unsigned char m_storage[inline_capacity];
+		manager_t m_manager;
+
+		template<class F>
+		static void manage(op_t op, Task& self, Task* other)
+		{
+			if constexpr (is_inline_v<F>)
+			{
+				F* f = std::launder(reinterpret_cast<F*>(self.m_storage));
+				switch (op)
+				{
+				case op_t::INVOKE:
+					(*f)();
+					break;
+				case op_t::MOVE:
+					::new (other->m_storage) F(std::move(*f));
+					f->~F();
+					break;
+				case op_t::DESTROY:
+					f->~F();
+					break;
+				}
+			}
+			else
+			{
+				F* f;
+				std::memcpy(&f, self.m_storage, sizeof(f));
+				switch (op)
+				{
+				case op_t::INVOKE:
+					(*f)();
+					break;
+				case op_t::MOVE:
+					std::memcpy(other->m_storage, &f, sizeof(f));
+					break;
+				case op_t::DESTROY:
+					delete f;
+					break;
+				}
+			}
+		}
+
+	public:
+		Task(void)
+			: m_manager(nullptr)
+		{
+		}
+
+		template<class F, class = std::enable_if_t<false == std::is_same_v<std::decay_t<F>, Task>>>
+		Task(F&& f)
+			: m_manager(&Task::manage<std::decay_t<F>>)
+		{
+			using D = std::decay_t<F>;
+			if constexpr (is_inline_v<D>)
+				::new (m_storage) D(std::forward<F>(f));
+			else
+			{
+				D* heap = new D(std::forward<F>(f));
+				std::memcpy(m_storage, &heap, sizeof(heap));
+			}
+		}
+
+		Task(Task&& task) noexcept
+			: m_manager(task.m_manager)
+		{
+			if (nullptr != m_manager)
+				m_manager(op_t::MOVE, task, this);
+			task.m_manager = nullptr;
+		}
+
+		Task& operator=(Task&& task) noexcept
+		{
+			if (this != &task)
+			{
+				this->reset();
+				if (nullptr != task.m_manager)
+					task.m_manager(op_t::MOVE, task, this);
+				m_manager = task.m_manager;
+				task.m_manager = nullptr;
+			}
+			return *this;
+		}
+
+		Task(Task const&) = delete;
+		Task& operator=(Task const&) = delete;
+
+		~Task(void)
+		{
+			this->reset();
+		}
+
+		void reset(void)
+		{
+			if (nullptr != m_manager)
+				m_manager(op_t::DESTROY, *this, nullptr);
+			m_manager = nullptr;
+		}
+
+		explicit operator bool() const
+		{
+			return nullptr != m_manager;
+		}
+
+		void operator()()
+		{
+			if (nullptr != m_manager)
+				m_manager(op_t::INVOKE, *this, nullptr);
+		}
+	};
+
+	struct TaskNode
+	{
+		Task m_task;
+		priority_t m_priority;
+		TaskNode* m_next;
+		// steady_clock times, in nanoseconds, of the submission, only stamped
+		// when wait times are measured, and of the deadline, if any
+		std::int64_t m_enqueued;
+		std::int64_t m_deadline;
+	};
+
+	// Lock-free pool of BlockSize-byte blocks. Threads allocate from and free to
+	// a thread-local cache. A thread whose cache runs dry takes the whole shared
+	// stack with one exchange, and a cache past cache_limit is handed back with
+	// one CAS. Blocks are never popped one by one from the shared stack, so it
+	// is free of ABA. Blocks are kept for the lifetime of the process.
+	template<std::size_t BlockSize>
+	class BlockPool
+	{
+		static constexpr std::size_t cache_limit = 256;
+
+		struct Block
+		{
+			Block* m_next;
+		};
+
+		static_assert(BlockSize >= sizeof(Block));
+
+		struct Cache
+		{
+			Block* m_head = nullptr;
+			Block* m_tail = nullptr;
+			std::size_t m_count = 0;
+
+			~Cache(void)
+			{
+				give_back(*this);
+			}
+		};
+
+		static inline std::atomic<Block*> shared = nullptr;
+
+		static Cache& cache(void)
+		{
+			thread_local Cache cache;
+			return cache;
+		}
+
+		static void give_back(Cache& cache)
+		{
+			if (nullptr == cache.m_head)
+				return;
+			cache.m_tail->m_next = shared.load(std::memory_order_relaxed);
+			while (false == shared.compare_exchange_weak(cache.m_tail->m_next, cache.m_head, std::memory_order_release, std::memory_order_relaxed))
+				;
+			cache.m_head = cache.m_tail = nullptr;
+			cache.m_count = 0;
+		}
+
+	public:
+		static void* allocate(void)
+		{
+			Cache& cache = BlockPool::cache();
+			if (nullptr == cache.m_head)
+			{
+				cache.m_head = shared.exchange(nullptr, std::memory_order_acquire);
+				for (Block* block = cache.m_head; nullptr != block; block = block->m_next, ++cache.m_count)
+					cache.m_tail = block;
+			}
+			if (nullptr == cache.m_head)
+				return ::operator new(BlockSize);
+
+			Block* block = cache.m_head;
+			cache.m_head = block->m_next;
+			if (nullptr == cache.m_head)
+				cache.m_tail = nullptr;
+			--cache.m_count;
+			return block;
+		}
+
+		static void deallocate(void* ptr)
+		{
+			Cache& cache = BlockPool::cache();
+			Block* block = ::new (ptr) Block{ cache.m_head };
+			cache.m_head = block;
+			if (nullptr == cache.m_tail)
+				cache.m_tail = block;
+			if (++cache.m_count > cache_limit)
+				give_back(cache);
+		}
+	};
+
+	// Routes small allocations, such as the shared state of promises or
+	// coroutine frames, to BlockPool size classes.
+	template<class T>
+	struct PoolAllocator
+	{
+		using value_type = T;
+
+		PoolAllocator(void) = default;
+
+		template<class U>
+		PoolAllocator(PoolAllocator<U> const&)
+		{
+		}
+
+		T* allocate(std::size_t count)
+		{
+			static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+			std::size_t size = count * sizeof(T);
+			if (size <= 64)
+				return static_cast<T*>(BlockPool<64>::allocate());
+			if (size <= 128)
+				return static_cast<T*>(BlockPool<128>::allocate());
+			if (size <= 256)
+				return static_cast<T*>(BlockPool<256>::allocate());
+			if (size <= 512)
+				return static_cast<T*>(BlockPool<512>::allocate());
+			if (size <= 1024)
+				return static_cast<T*>(BlockPool<1024>::allocate());
+			return static_cast<T*>(::operator new(size));
+		}
+
+		void deallocate(T* ptr, std::size_t count)
+		{
+			std::size_t size = count * sizeof(T);
+			if (size <= 64)
+				BlockPool<64>::deallocate(ptr);
+			else if (size <= 128)
+				BlockPool<128>::deallocate(ptr);
+			else if (size <= 256)
+				BlockPool<256>::deallocate(ptr);
+			else if (size <= 512)
+				BlockPool<512>::deallocate(ptr);
+			else if (size <= 1024)
+				BlockPool<1024>::deallocate(ptr);
+			else
+				::operator delete(ptr);
+		}
+
+		template<class U>
+		bool operator==(PoolAllocator<U> const&) const
+		{
+			return true;
+		}
+	};
+
+	template<class F>
+	static TaskNode* make_node(F&& task, priority_t priority)
+	{
+		void* block = BlockPool<sizeof(TaskNode)>::allocate();
+		try
+		{
+			return ::new (block) TaskNode{ Task(std::forward<F>(task)), priority, nullptr, 0, 0 };
+		}
+		catch (...)
+		{
+			BlockPool<sizeof(TaskNode)>::deallocate(block);
+			throw;
+		}
+	}
+
+	static void free_node(TaskNode* node)
+	{
+		node->~TaskNode();
+		BlockPool<sizeof(TaskNode)>::deallocate(node);
+	}
+
+	// Shared state behind Future. Continuations are task nodes: they are kept
+	// in m_continuations until the state is ready, and enqueued on the pool
+	// from then on.
+	template<class T>
+	class FutureState
+	{
+		friend class ThreadPool;
+
+		using value_t = std::conditional_t<std::is_void_v<T>, bool, T>;
+
+		ThreadPool* const m_pool;
+		std::optional<value_t> m_value;
+		std::exception_ptr m_error;
+		std::atomic<TaskNode*> m_continuations;
+		std::atomic<bool> m_ready;
+
+		static TaskNode* ready_tag(void)
+		{
+			return reinterpret_cast<TaskNode*>(std::uintptr_t(1));
+		}
+
+		void publish(void)
+		{
+			m_ready.store(true, std::memory_order_release);
+			m_ready.notify_all();
+			TaskNode* node = m_continuations.exchange(ready_tag(), std::memory_order_acq_rel);
+			while (nullptr != node)
+			{
+				TaskNode* next = node->m_next;
+				m_pool->enqueue_chain(node, node, 1, node->m_priority);
+				node = next;
+			}
+		}
+
+	public:
+		explicit FutureState(ThreadPool* pool)
+			: m_pool(pool)
+			, m_continuations(nullptr)
+			, m_ready(false)
+		{
+		}
+
+		template<class C>
+		void fulfil(C&& compute)
+		{
+			try
+			{
+				if constexpr (std::is_void_v<T>)
+				{
+					compute();
+					m_value.emplace(true);
+				}
+				else
+					m_value.emplace(compute());
+			}
+			catch (...)
+			{
+				m_error = std::current_exception();
+			}
+			this->publish();
+		}
+
+		void fail(std::exception_ptr error)
+		{
+			m_error = error;
+			this->publish();
+		}
+
+		void add_continuation(TaskNode* node)
+		{
+			TaskNode* head = m_continuations.load(std::memory_order_acquire);
+			do
+			{
+				if (ready_tag() == head)
+				{
+					m_pool->enqueue_chain(node, node, 1, node->m_priority);
+					return;
+				}
+				node->m_next = head;
+			}
+			while (false == m_continuations.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_acquire));
+		}
+
+		bool is_ready(void) const
+		{
+			return m_ready.load(std::memory_order_acquire);
+		}
+
+		void wait(void) const
+		{
+			m_ready.wait(false, std::memory_order_acquire);
+		}
+	};
+
+	// Write end of a FutureState. A producer destroyed before fulfilling its
+	// state, e.g. with a task dropped by the pool destructor, breaks it, so
+	// that continuations always run.
+	template<class T>
+	class Producer
+	{
+		std::shared_ptr<FutureState<T>> m_state;
+
+	public:
+		explicit Producer(std::shared_ptr<FutureState<T>> state)
+			: m_state(std::move(state))
+		{
+		}
+
+		Producer(Producer&&) noexcept = default;
+		Producer& operator=(Producer&&) = delete;
+
+		~Producer(void)
+		{
+			if (nullptr != m_state)
+				m_state->fail(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+		}
+
+		template<class C>
+		void fulfil(C&& compute)
+		{
+			std::shared_ptr<FutureState<T>> state = std::move(m_state);
+			state->fulfil(std::forward<C>(compute));
+		}
+
+		void fail(std::exception_ptr error)
+		{
+			std::shared_ptr<FutureState<T>> state = std::move(m_state);
+			state->fail(error);
+		}
+	};
+
+	template<class T>
+	std::shared_ptr<FutureState<T>> make_state(void)
+	{
+		return std::allocate_shared<FutureState<T>>(PoolAllocator<FutureState<T>>(), this);
+	}
+
+public:
+
+	// Result of submit(). Unlike std::future it can be chained on with then()
+	// or combined with when_all() and when_any(); continuations are scheduled
+	// when the result is ready, so no worker ever blocks waiting for it.
+	// get() does block, and is meant for threads outside the pool.
+	template<class T>
+	class Future
+	{
+		friend class ThreadPool;
+
+		std::shared_ptr<FutureState<T>> m_state;
+
+		explicit Future(std::shared_ptr<FutureState<T>> state)
+			: m_state(std::move(state))
+		{
+		}
+
+	public:
+		Future(void) = default;
+
+		bool valid(void) const
+		{
+			return nullptr != m_state;
+		}
+
+		bool is_ready(void) const
+		{
+			return m_state->is_ready();
+		}
+
+		void wait(void) const
+		{
+			m_state->wait();
+		}
+
+		// The value lives as long as any Future sharing the state.
+		std::add_lvalue_reference_t<T> get(void) const
+		{
+			m_state->wait();
+			if (nullptr != m_state->m_error)
+				std::rethrow_exception(m_state->m_error);
+			if constexpr (false == std::is_void_v<T>)
+				return *m_state->m_value;
+		}
+
+		// Runs f(value), or f() for Future<void>, on the pool once this result is
+		// ready. An exception held by this result is passed on without calling f.
+		template<class F>
+		auto then(F&& f, priority_t priority = priority_t::MEDIUM)
+		{
+			using R = typename std::conditional_t<std::is_void_v<T>, std::invoke_result<std::decay_t<F>&>, std::invoke_result<std::decay_t<F>&, std::add_lvalue_reference_t<T>>>::type;
+			auto next = m_state->m_pool->template make_state<R>();
+			TaskNode* node = make_node
+			(
+				[antecedent = m_state, producer = Producer<R>(next), f = std::forward<F>(f)]() mutable
+				{
+					if (nullptr != antecedent->m_error)
+						return producer.fail(antecedent->m_error);
+					producer.fulfil
+					(
+						[&]() -> R
+						{
+							if constexpr (std::is_void_v<T>)
+								return f();
+							else
+								return f(*antecedent->m_value);
+						}
+					);
+				}, priority
+			);
+			m_state->add_continuation(node);
+			return Future<R>(std::move(next));
+		}
+
+		// Lets a CoTask wait for the result without holding a worker: the
+		// coroutine is resumed on the pool once the result is ready.
+		auto operator co_await() const noexcept
+		{
+			struct Awaiter
+			{
+				std::shared_ptr<FutureState<T>> m_state;
+
+				bool await_ready(void) const noexcept
+				{
+					return m_state->is_ready();
+				}
+
+				void await_suspend(std::coroutine_handle<> handle) const
+				{
+					m_state->add_continuation(make_node([handle]() { handle.resume(); }, priority_t::MEDIUM));
+				}
+
+				std::add_lvalue_reference_t<T> await_resume(void) const
+				{
+					return Future(m_state).get();
+				}
+			};
+			return Awaiter{ m_state };
+		}
+	};
+
+	// Runs f(args...) and returns its result as a Future.
+	template<class F, class ...Args>
+	auto submit(F&& f, priority_t priority, Args&& ... args)
+	{
+		using R = std::invoke_result_t<std::decay_t<F>&, std::decay_t<Args>...>;
+		auto state = this->make_state<R>();
+		this->prepare_task_internal
+		(
+			[producer = Producer<R>(state), f = std::forward<F>(f), args = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)]() mutable
+			{
+				producer.fulfil([&]() -> R { return std::apply(f, std::move(args)); });
+			}, priority
+		);
+		return Future<R>(std::move(state));
+	}
+
+	// As submit(), with a deadline for the EDF policy; the other policies
+	// only look at the priority.
+	template<class F, class ...Args>
+	auto submit_before(std::chrono::steady_clock::time_point deadline, F&& f, priority_t priority, Args&& ... args)
+	{
+		using R = std::invoke_result_t<std::decay_t<F>&, std::decay_t<Args>...>;
+		auto state = this->make_state<R>();
+		this->prepare_task_internal
+		(
+			[producer = Producer<R>(state), f = std::forward<F>(f), args = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)]() mutable
+			{
+				producer.fulfil([&]() -> R { return std::apply(f, std::move(args)); });
+			}, priority,
+			std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count()
+		);
+		return Future<R>(std::move(state));
+	}
+
+	// Ready once all futures are; holds their values in order, or the
+	// exception of the first failed one.
+	template<class T>
+	auto when_all(std::vector<Future<T>> futures, priority_t priority = priority_t::MEDIUM)
+	{
+		using R = std::conditional_t<std::is_void_v<T>, void, std::vector<T>>;
+		struct Join
+		{
+			Producer<R> m_producer;
+			std::vector<Future<T>> m_futures;
+			std::atomic<std::size_t> m_remaining;
+
+			void complete(void)
+			{
+				for (auto& future : m_futures)
+					if (nullptr != future.m_state->m_error)
+						return m_producer.fail(future.m_state->m_error);
+				m_producer.fulfil
+				(
+					[this]() -> R
+					{
+						if constexpr (false == std::is_void_v<T>)
+						{
+							R res;
+							res.reserve(m_futures.size());
+							for (auto& future : m_futures)
+								res.push_back(*future.m_state->m_value);
+							return res;
+						}
+					}
+				);
+			}
+		};
+
+		auto state = this->make_state<R>();
+		auto join = std::make_shared<Join>(Producer<R>(state), std::move(futures));
+		join->m_remaining.store(join->m_futures.size(), std::memory_order_relaxed);
+		if (true == join->m_futures.empty())
+			join->complete();
+		for (auto& future : join->m_futures)
+			future.m_state->add_continuation(make_node([join]() { if (1 == join->m_remaining.fetch_sub(1, std::memory_order_acq_rel)) join->complete(); }, priority));
+		return Future<R>(std::move(state));
+	}
+
+	// Ready as soon as one of futures is, with its index.
+	template<class T>
+	Future<std::size_t> when_any(std::vector<Future<T>> futures, priority_t priority = priority_t::MEDIUM)
+	{
+		struct Join
+		{
+			Producer<std::size_t> m_producer;
+			std::atomic<bool> m_done;
+		};
+
+		auto state = this->make_state<std::size_t>();
+		auto join = std::make_shared<Join>(Producer<std::size_t>(state));
+		if (true == futures.empty())
+			join->m_producer.fail(std::make_exception_ptr(std::invalid_argument("when_any() of no futures")));
+		for (std::size_t i = 0; i < futures.size(); ++i)
+			futures[i].m_state->add_continuation(make_node([join, i]() { if (false == join->m_done.exchange(true, std::memory_order_acq_rel)) join->m_producer.fulfil([i]() { return i; }); }, priority));
+		return Future<std::size_t>(std::move(state));
+	}
+
+	// Tasks with dependencies. A task is scheduled once all of its
+	// predecessors finished, by whichever of them finished last, through an
+	// atomic counter; nothing blocks. The graph may be run again once the
+	// previous run completed, and must outlive its runs.
+	class TaskGraph
+	{
+		friend class ThreadPool;
+
+		struct Node
+		{
+			Task m_task;
+			priority_t m_priority;
+			std::vector<std::size_t> m_successors;
+			std::size_t m_predecessors = 0;
+			std::atomic<std::size_t> m_pending = 0;
+		};
+
+		std::vector<std::unique_ptr<Node>> m_nodes;
+		std::atomic<bool> m_running = false;
+
+		struct Run
+		{
+			TaskGraph* m_graph;
+			ThreadPool* m_pool;
+			Producer<void> m_producer;
+			std::atomic<std::size_t> m_remaining;
+			std::atomic<bool> m_failed;
+			std::exception_ptr m_error;
+		};
+
+		static void schedule(std::shared_ptr<Run> const& run, std::size_t index)
+		{
+			Node& node = *run->m_graph->m_nodes[index];
+			run->m_pool->prepare_task_internal([run, index]() { execute(run, index); }, node.m_priority);
+		}
+
+		static void execute(std::shared_ptr<Run> const& run, std::size_t index)
+		{
+			TaskGraph& graph = *run->m_graph;
+			Node& node = *graph.m_nodes[index];
+			if (false == run->m_failed.load(std::memory_order_relaxed))
+			{
+				try
+				{
+					node.m_task();
+				}
+				catch (...)
+				{
+					if (false == run->m_failed.exchange(true, std::memory_order_relaxed))
+						run->m_error = std::current_exception();
+				}
+			}
+			for (std::size_t successor : node.m_successors)
+				if (1 == graph.m_nodes[successor]->m_pending.fetch_sub(1, std::memory_order_acq_rel))
+					schedule(run, successor);
+			if (1 == run->m_remaining.fetch_sub(1, std::memory_order_acq_rel))
+			{
+				graph.m_running.store(false, std::memory_order_release);
+				if (true == run->m_failed.load(std::memory_order_relaxed))
+					run->m_producer.fail(run->m_error);
+				else
+					run->m_producer.fulfil([]() {});
+			}
+		}
+
+		bool is_acyclic(void) const
+		{
+			std::vector<std::size_t> pending(m_nodes.size());
+			std::vector<std::size_t> ready;
+			for (std::size_t i = 0; i < m_nodes.size(); ++i)
+				if (0 == (pending[i] = m_nodes[i]->m_predecessors))
+					ready.push_back(i);
+			std::size_t visited = 0;
+			while (false == ready.empty())
+			{
+				std::size_t index = ready.back();
+				ready.pop_back();
+				++visited;
+				for (std::size_t successor : m_nodes[index]->m_successors)
+					if (0 == --pending[successor])
+						ready.push_back(successor);
+			}
+			return m_nodes.size() == visited;
+		}
+
+	public:
+		using node_t = std::size_t;
+
+		TaskGraph(void) = default;
+		TaskGraph(TaskGraph const&) = delete;
+		TaskGraph& operator=(TaskGraph const&) = delete;
+
+		template<class F>
+		node_t add(F&& f, priority_t priority = priority_t::MEDIUM)
+		{
+			m_nodes.emplace_back(new Node{ Task(std::forward<F>(f)), priority, {}, 0, 0 });
+			return m_nodes.size() - 1;
+		}
+
+		// after runs once before finished.
+		void precede(node_t before, node_t after)
+		{
+			m_nodes.at(before)->m_successors.push_back(after);
+			++m_nodes.at(after)->m_predecessors;
+		}
+
+		// Schedules the tasks without predecessors; the future holds the first
+		// exception thrown by a task, after which the remaining tasks are skipped.
+		Future<void> run(ThreadPool& pool)
+		{
+			if (false == this->is_acyclic())
+				throw std::runtime_error("TaskGraph contains a cycle");
+			if (true == m_running.exchange(true, std::memory_order_acq_rel))
+				throw std::runtime_error("TaskGraph is already running");
+
+			auto state = pool.make_state<void>();
+			auto run = std::make_shared<Run>(this, &pool, Producer<void>(state));
+			run->m_remaining.store(m_nodes.size(), std::memory_order_relaxed);
+			for (auto& node : m_nodes)
+				node->m_pending.store(node->m_predecessors, std::memory_order_relaxed);
+			if (true == m_nodes.empty())
+			{
+				m_running.store(false, std::memory_order_release);
+				run->m_producer.fulfil([]() {});
+			}
+			for (std::size_t i = 0; i < m_nodes.size(); ++i)
+				if (0 == m_nodes[i]->m_predecessors)
+					schedule(run, i);
+			return Future<void>(std::move(state));
+		}
+	};
+
+	// Awaiting it resumes the coroutine on a worker of the pool.
+	class ScheduleAwaiter
+	{
+		ThreadPool* const m_pool;
+		priority_t const m_priority;
+
+	public:
+		ScheduleAwaiter(ThreadPool* pool, priority_t priority)
+			: m_pool(pool)
+			, m_priority(priority)
+		{
+		}
+
+		bool await_ready(void) const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle) const
+		{
+			m_pool->prepare_task_internal([handle]() { handle.resume(); }, m_priority);
+		}
+
+		void await_resume(void) const noexcept
+		{
+		}
+	};
+
+	// co_await pool.schedule() moves the calling coroutine to the pool.
+	// Coroutines still suspended there when the pool is destroyed are never
+	// resumed.
+	ScheduleAwaiter schedule(priority_t priority = priority_t::MEDIUM)
+	{
+		return ScheduleAwaiter(this, priority);
+	}
+
+	// Lazily started coroutine. co_await on it starts it on the awaiting
+	// thread and resumes the awaiter, through symmetric transfer, once it
+	// completes; start it on the pool with spawn(). Frames are allocated from
+	// the pool's block pools.
+	template<class T = void>
+	class CoTask
+	{
+		friend class ThreadPool;
+
+		template<class V>
+		struct Result
+		{
+			std::optional<V> m_value;
+
+			template<class U>
+			void return_value(U&& value)
+			{
+				m_value.emplace(std::forward<U>(value));
+			}
+
+			V take(void)
+			{
+				return std::move(*m_value);
+			}
+		};
+
+		template<class V>
+		struct Result<V&>
+		{
+			V* m_value = nullptr;
+
+			void return_value(V& value)
+			{
+				m_value = &value;
+			}
+
+			V& take(void)
+			{
+				return *m_value;
+			}
+		};
+
+		struct ResultVoid
+		{
+			void return_void(void)
+			{
+			}
+
+			void take(void)
+			{
+			}
+		};
+
+	public:
+		struct promise_type : std::conditional_t<std::is_void_v<T>, ResultVoid, Result<T>>
+		{
+			std::coroutine_handle<> m_continuation;
+			std::exception_ptr m_error;
+
+			struct FinalAwaiter
+			{
+				bool await_ready(void) const noexcept
+				{
+					return false;
+				}
+
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) const noexcept
+				{
+					std::coroutine_handle<> continuation = handle.promise().m_continuation;
+					return nullptr != continuation ? continuation : std::noop_coroutine();
+				}
+
+				void await_resume(void) const noexcept
+				{
+				}
+			};
+
+			CoTask get_return_object(void)
+			{
+				return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+
+			std::suspend_always initial_suspend(void) const noexcept
+			{
+				return {};
+			}
+
+			FinalAwaiter final_suspend(void) const noexcept
+			{
+				return {};
+			}
+
+			void unhandled_exception(void)
+			{
+				m_error = std::current_exception();
+			}
+
+			static void* operator new(std::size_t size)
+			{
+				return PoolAllocator<char>().allocate(size);
+			}
+
+			static void operator delete(void* ptr, std::size_t size)
+			{
+				PoolAllocator<char>().deallocate(static_cast<char*>(ptr), size);
+			}
+		};
+
+	private:
+		std::coroutine_handle<promise_type> m_handle;
+
+		explicit CoTask(std::coroutine_handle<promise_type> handle)
+			: m_handle(handle)
+		{
+		}
+
+		struct Awaiter
+		{
+			std::coroutine_handle<promise_type> m_handle;
+
+			bool await_ready(void) const noexcept
+			{
+				return m_handle.done();
+			}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) const noexcept
+			{
+				m_handle.promise().m_continuation = awaiting;
+				return m_handle;
+			}
+
+			T await_resume(void) const
+			{
+				if (nullptr != m_handle.promise().m_error)
+					std::rethrow_exception(m_handle.promise().m_error);
+				return m_handle.promise().take();
+			}
+		};
+
+	public:
+		CoTask(CoTask&& task) noexcept
+			: m_handle(std::exchange(task.m_handle, nullptr))
+		{
+		}
+
+		CoTask& operator=(CoTask&& task) noexcept
+		{
+			if (this != &task)
+			{
+				if (nullptr != m_handle)
+					m_handle.destroy();
+				m_handle = std::exchange(task.m_handle, nullptr);
+			}
+			return *this;
+		}
+
+		CoTask(CoTask const&) = delete;
+		CoTask& operator=(CoTask const&) = delete;
+
+		~CoTask(void)
+		{
+			if (nullptr != m_handle)
+				m_handle.destroy();
+		}
+
+		Awaiter operator co_await() && noexcept
+		{
+			return Awaiter{ m_handle };
+		}
+	};
+
+	// Starts task on the pool; the future becomes ready when it completes.
+	template<class T>
+	Future<T> spawn(CoTask<T> task, priority_t priority = priority_t::MEDIUM)
+	{
+		auto state = this->make_state<T>();
+		drive(*this, priority, std::move(task), Producer<T>(state));
+		return Future<T>(std::move(state));
+	}
+
+private:
+
+	// Eagerly started coroutine whose frame frees itself on completion.
+	struct Detached
+	{
+		struct promise_type
+		{
+			Detached get_return_object(void) const noexcept
+			{
+				return {};
+			}
+
+			std::suspend_never initial_suspend(void) const noexcept
+			{
+				return {};
+			}
+
+			std::suspend_never final_suspend(void) const noexcept
+			{
+				return {};
+			}
+
+			void return_void(void) const noexcept
+			{
+			}
+
+			void unhandled_exception(void) const noexcept
+			{
+				std::terminate();
+			}
+
+			static void* operator new(std::size_t size)
+			{
+				return PoolAllocator<char>().allocate(size);
+			}
+
+			static void operator delete(void* ptr, std::size_t size)
+			{
+				PoolAllocator<char>().deallocate(static_cast<char*>(ptr), size);
+			}
+		};
+	};
+
+	template<class T>
+	static Detached drive(ThreadPool& pool, priority_t priority, CoTask<T> task, Producer<T> producer)
+	{
+		co_await pool.schedule(priority);
+		std::exception_ptr error;
+		try
+		{
+			if constexpr (std::is_void_v<T>)
+			{
+				co_await std::move(task);
+				producer.fulfil([]() {});
+			}
+			else
+			{
+				std::optional<T> value;
+				value.emplace(co_await std::move(task));
+				producer.fulfil([&value]() -> T { return std::move(*value); });
+			}
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+		if (nullptr != error)
+			producer.fail(error);
+	}
+
+	// Chase-Lev deque (Le, Pop, Cohen, Zappa Nardelli, "Correct and Efficient
+	// Work-Stealing for Weak Memory Models"). The owner pushes at the bottom;
+	// the owner and thieves take from the top, so tasks run oldest first.
+	// Outgrown arrays are kept until the deque is destroyed, since a thief
+	// may still be reading them.
+	class WorkStealingDeque
+	{
+		struct Array
+		{
+			std::int64_t const m_capacity;
+			std::unique_ptr<std::atomic<TaskNode*>[]> const m_slots;
+
+			explicit Array(std::int64_t capacity)
+				: m_capacity(capacity)
+				, m_slots(new std::atomic<TaskNode*>[capacity])
+			{
+			}
+
+			TaskNode* get(std::int64_t index) const
+			{
+				return m_slots[index & (m_capacity - 1)].load(std::memory_order_acquire);
+			}
+
+			void put(std::int64_t index, TaskNode* node)
+			{
+				m_slots[index & (m_capacity - 1)].store(node, std::memory_order_release);
+			}
+		};
+
+		std::atomic<std::int64_t> m_top;
+		std::atomic<std::int64_t> m_bottom;
+		std::atomic<Array*> m_array;
+		std::vector<std::unique_ptr<Array>> m_arrays;
+
+	public:
+		WorkStealingDeque(void)
+			: m_top(0)
+			, m_bottom(0)
+		{
+			m_arrays.emplace_back(new Array(64));
+			m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+		}
+
+		WorkStealingDeque(WorkStealingDeque const&) = delete;
+		WorkStealingDeque& operator=(WorkStealingDeque const&) = delete;
+
+		// Owner only.
+		void push(TaskNode* node)
+		{
+			std::int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+			std::int64_t top = m_top.load(std::memory_order_acquire);
+			Array* array = m_array.load(std::memory_order_relaxed);
+			if (bottom - top > array->m_capacity - 1)
+			{
+				Array* grown = new Array(array->m_capacity * 2);
+				for (std::int64_t i = top; i < bottom; ++i)
+					grown->put(i, array->get(i));
+				m_arrays.emplace_back(grown);
+				m_array.store(grown, std::memory_order_release);
+				array = grown;
+			}
+			array->put(bottom, node);
+			std::atomic_thread_fence(std::memory_order_release);
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+		}
+
+		// Owner only; takes the oldest node, like a thief that never fails.
+		TaskNode* take(void)
+		{
+			while (m_top.load(std::memory_order_relaxed) < m_bottom.load(std::memory_order_relaxed))
+				if (TaskNode* node = this->steal())
+					return node;
+			return nullptr;
+		}
+
+		// Any thread; fails spuriously when racing with another thief.
+		TaskNode* steal(void)
+		{
+			std::int64_t top = m_top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			std::int64_t bottom = m_bottom.load(std::memory_order_acquire);
+			if (top >= bottom)
+				return nullptr;
+
+			TaskNode* node = m_array.load(std::memory_order_acquire)->get(top);
+			if (false == m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return nullptr;
+			return node;
+		}
+	};
+
+	struct Span
+	{
+		std::int64_t m_start;
+		std::int64_t m_duration;
+		std::uint32_t m_worker;
+		std::uint32_t m_priority;
+	};
+
+	// Counters written only by their worker, read by anyone.
+	static void add(std::atomic<std::uint64_t>& counter, std::uint64_t value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	struct Worker
+	{
+		ThreadPool* const m_pool;
+		std::size_t const m_index;
+		std::size_t const m_node;
+		WorkStealingDeque m_deques[priority_count];
+		std::uint64_t m_random;
+		// see WorkerMetrics
+		std::atomic<std::uint64_t> m_executed;
+		std::atomic<std::uint64_t> m_steal_attempts;
+		std::atomic<std::uint64_t> m_steals;
+		std::atomic<std::uint64_t> m_busy_ns;
+		std::atomic<std::uint64_t> m_idle_ns;
+		// start of the current idle period while timed, 0 otherwise
+		std::atomic<std::int64_t> m_idle_since;
+		// false once the thread of the slot is done with it
+		std::atomic<bool> m_running;
+		// stride scheduling state of the WEIGHTED policy
+		std::uint64_t m_pass[priority_count];
+		std::uint64_t m_vtime;
+		std::atomic<std::uint64_t> m_wait[priority_count][Histogram::bucket_count];
+		std::atomic<std::uint64_t> m_run[priority_count][Histogram::bucket_count];
+		// ring of the last trace_capacity spans
+		mutable std::mutex m_trace_mutex;
+		std::vector<Span> m_spans;
+		std::size_t m_span_count;
+
+		Worker(ThreadPool* pool, std::size_t index, std::size_t node)
+			: m_pool(pool)
+			, m_index(index)
+			, m_node(node)
+			, m_random(0x9E3779B97F4A7C15ull * (index + 1))
+			, m_executed(0)
+			, m_steal_attempts(0)
+			, m_steals(0)
+			, m_busy_ns(0)
+			, m_idle_ns(0)
+			, m_idle_since(0)
+			, m_running(true)
+			, m_pass{}
+			, m_vtime(0)
+			, m_wait{}
+			, m_run{}
+			, m_span_count(0)
+		{
+		}
+
+		void add_metrics(Metrics& metrics, std::int64_t now) const
+		{
+			if (metrics.m_workers.size() <= m_index)
+				metrics.m_workers.resize(m_index + 1);
+			WorkerMetrics& res = metrics.m_workers[m_index];
+			res.m_tasks += m_executed.load(std::memory_order_relaxed);
+			res.m_steal_attempts += m_steal_attempts.load(std::memory_order_relaxed);
+			res.m_steals += m_steals.load(std::memory_order_relaxed);
+			res.m_busy_ns += m_busy_ns.load(std::memory_order_relaxed);
+			res.m_idle_ns += m_idle_ns.load(std::memory_order_relaxed);
+			if (std::int64_t since = m_idle_since.load(std::memory_order_relaxed); 0 != since && now > since)
+				res.m_idle_ns += now - since;
+			for (std::size_t priority = 0; priority < priority_count; ++priority)
+			{
+				for (std::size_t i = 0; i < Histogram::bucket_count; ++i)
+				{
+					metrics.m_wait[priority].m_counts[i] += m_wait[priority][i].load(std::memory_order_relaxed);
+					metrics.m_run[priority].m_counts[i] += m_run[priority][i].load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		void record_span(std::int64_t start, std::int64_t end, std::size_t priority)
+		{
+			Span span{ start, end - start, static_cast<std::uint32_t>(m_index), static_cast<std::uint32_t>(priority) };
+			std::unique_lock<std::mutex> lock(m_trace_mutex);
+			if (m_spans.size() < trace_capacity)
+				m_spans.push_back(span);
+			else
+				m_spans[m_span_count % trace_capacity] = span;
+			++m_span_count;
+		}
+
+		void copy_spans(std::vector<Span>& spans) const
+		{
+			std::unique_lock<std::mutex> lock(m_trace_mutex);
+			spans.insert(spans.end(), m_spans.begin(), m_spans.end());
+		}
+
+		void move_spans(std::vector<Span>& spans)
+		{
+			this->copy_spans(spans);
+			this->clear_spans();
+		}
+
+		void clear_spans(void)
+		{
+			std::unique_lock<std::mutex> lock(m_trace_mutex);
+			m_spans.clear();
+			m_span_count = 0;
+		}
+
+		// xorshift64
+		std::uint64_t next_random(void)
+		{
+			m_random ^= m_random << 13;
+			m_random ^= m_random >> 7;
+			m_random ^= m_random << 17;
+			return m_random;
+		}
+	};
+
+	struct alignas(64) Node
+	{
+		std::atomic<TaskNode*> m_injected{nullptr};
+	};
+
+	static inline thread_local Worker* this_worker = nullptr;
+
+	// "0-3,8,10-11" -> 0, 1, 2, 3, 8, 10, 11
+	static std::vector<int> parse_cpu_list(std::string const& list)
+	{
+		std::vector<int> res;
+		char const* pos = list.c_str();
+		while ('\0' != *pos)
+		{
+			char* end = nullptr;
+			long first = std::strtol(pos, &end, 10);
+			if (end == pos)
+				break;
+			long last = first;
+			pos = end;
+			if ('-' == *pos)
+			{
+				last = std::strtol(pos + 1, &end, 10);
+				pos = end;
+			}
+			for (long cpu = first; cpu <= last; ++cpu)
+				res.push_back(static_cast<int>(cpu));
+			if (',' != *pos)
+				break;
+			++pos;
+		}
+		return res;
+	}
+
+	// CPUs of every NUMA node the process may run on, by node number. Without
+	// NUMA information in sysfs, all the allowed CPUs form a single node.
+	static std::vector<std::vector<int>> numa_topology(void)
+	{
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (0 != sched_getaffinity(0, sizeof(allowed), &allowed))
+			for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+				CPU_SET(cpu, &allowed);
+
+		std::vector<std::pair<int, std::vector<int>>> nodes;
+		std::error_code error;
+		for (auto const& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error))
+		{
+			std::string name = entry.path().filename().string();
+			if (name.size() <= 4 || 0 != name.compare(0, 4, "node")
+				|| false == std::all_of(name.begin() + 4, name.end(), [](char c) { return c >= '0' && c <= '9'; }))
+				continue;
+			std::ifstream file(entry.path() / "cpulist");
+			std::string list;
+			std::getline(file, list);
+			std::vector<int> cpus;
+			for (int cpu : parse_cpu_list(list))
+				if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+					cpus.push_back(cpu);
+			if (false == cpus.empty())
+				nodes.emplace_back(std::stoi(name.substr(4)), std::move(cpus));
+		}
+		std::sort(nodes.begin(), nodes.end());
+
+		std::vector<std::vector<int>> res;
+		for (auto& node : nodes)
+			res.push_back(std::move(node.second));
+		if (true == res.empty())
+		{
+			res.emplace_back();
+			for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+				if (CPU_ISSET(cpu, &allowed))
+					res.back().push_back(cpu);
+		}
+		return res;
+	}
+
+	// Worker i belongs to node i % m_node_count, so every node in use gets
+	// workers and they are spread evenly.
+	void pin(std::size_t index, std::size_t node)
+	{
+		if (placement_t::NONE == m_placement)
+			return;
+		std::vector<int> const& cpus = m_topology[node];
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (placement_t::CORES == m_placement)
+			CPU_SET(cpus[(index / m_node_count) % cpus.size()], &set);
+		else
+			for (int cpu : cpus)
+				CPU_SET(cpu, &set);
+		if (int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); 0 != error)
+			LOGF(Logger::WARNING, "Could not pin ThreadPool worker %zu: %s", index, std::strerror(error));
+	}
+
+	// Brings the number of running workers up to the capacity, reusing the
+	// slots of retired workers first. New workers are all created before
+	// being published to thieves. Called with m_mutex held.
+	void launch_workers(void)
+	{
+		std::size_t capacity = m_capacity.load(std::memory_order_relaxed);
+		for (std::size_t i = 0; i < m_workers.size() && m_active.load(std::memory_order_relaxed) < capacity; ++i)
+		{
+			Worker& worker = *m_workers[i];
+			if (true == worker.m_running.load(std::memory_order_acquire))
+				continue;
+			if (m_threads[i].joinable())
+				m_threads[i].join();
+			worker.m_running.store(true, std::memory_order_relaxed);
+			m_active.fetch_add(1, std::memory_order_relaxed);
+			try
+			{
+				m_threads[i] = std::thread(&ThreadPool::attach, this, std::ref(worker));
+			}
+			catch (...)
+			{
+				worker.m_running.store(false, std::memory_order_relaxed);
+				m_active.fetch_sub(1, std::memory_order_relaxed);
+				throw;
+			}
+		}
+
+		std::size_t active = m_active.load(std::memory_order_relaxed);
+		if (active >= capacity)
+			return;
+		std::size_t count = capacity - active;
+		std::size_t first = m_workers.size();
+		std::vector<Worker*> created(count, nullptr);
+		auto started = std::make_shared<std::latch>(count + 1);
+		std::exception_ptr error;
+		std::size_t launched = 0;
+		m_threads.reserve(first + count);
+		try
+		{
+			for (; launched < count; ++launched)
+				m_threads.emplace_back(&ThreadPool::create, this, first + launched, &created[launched], started);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+			started->count_down(count - launched);
+		}
+		started->arrive_and_wait();
+
+		for (std::size_t i = 0; i < launched; ++i)
+			m_workers.emplace_back(created[i]);
+		m_active.fetch_add(launched, std::memory_order_relaxed);
+		this->publish_workers();
+		if (nullptr != error)
+			std::rethrow_exception(error);
+	}
+
+	// Thieves read the table without locking, so replaced tables are kept
+	// until the pool stops.
+	void publish_workers(void)
+	{
+		std::unique_ptr<Worker*[]> table(new Worker*[m_workers.size()]);
+		for (std::size_t i = 0; i < m_workers.size(); ++i)
+			table[i] = m_workers[i].get();
+		m_table.store(table.get(), std::memory_order_release);
+		m_table_size.store(m_workers.size(), std::memory_order_release);
+		m_tables.push_back(std::move(table));
+	}
+
+	void create(std::size_t index, Worker** created, std::shared_ptr<std::latch> started)
+	{
+		std::size_t node = index % m_node_count;
+		this->pin(index, node);
+		// Allocated once pinned, so that the deques are first touched, and
+		// placed, on the worker's node.
+		Worker* worker = new Worker(this, index, node);
+		*created = worker;
+		started->arrive_and_wait();
+		started.reset();
+		this->run(*worker);
+	}
+
+	void attach(Worker& worker)
+	{
+		this->pin(worker.m_index, worker.m_node);
+		this->run(worker);
+	}
+
+	void run(Worker& worker)
+	{
+		this_worker = &worker;
+		while (false == this->m_stop_requested.load(std::memory_order_acquire))
+		{
+			if (true == this->retire(worker))
+				break;
+			TaskNode* node = this->find_task(worker);
+			if (nullptr == node)
+			{
+				std::int64_t idle = true == m_metrics.load(std::memory_order_relaxed) ? clock_ns() : 0;
+				worker.m_idle_since.store(idle, std::memory_order_relaxed);
+				node = this->wait_for_task(worker);
+				if (0 != idle)
+				{
+					worker.m_idle_since.store(0, std::memory_order_relaxed);
+					add(worker.m_idle_ns, clock_ns() - idle);
+				}
+			}
+			if (nullptr == node)
+				continue;
+			if (0 != node->m_enqueued)
+				this->record_wait(worker, *node);
+			std::size_t priority = static_cast<std::size_t>(node->m_priority);
+			Task task = std::move(node->m_task);
+			free_node(node);
+			if (false == m_metrics.load(std::memory_order_relaxed) && false == m_tracing.load(std::memory_order_relaxed))
+				task();
+			else
+			{
+				std::int64_t start = clock_ns();
+				task();
+				this->record_run(worker, priority, start, clock_ns());
+			}
+			add(worker.m_executed, 1);
+		}
+		this_worker = nullptr;
+		worker.m_running.store(false, std::memory_order_release);
+	}
+
+	// A worker above the capacity leaves, handing its queued tasks over to
+	// the injection stack of its node.
+	bool retire(Worker& worker)
+	{
+		std::size_t active = m_active.load(std::memory_order_relaxed);
+		while (active > m_capacity.load(std::memory_order_relaxed))
+		{
+			if (true == m_active.compare_exchange_weak(active, active - 1, std::memory_order_relaxed))
+			{
+				if (0 != this->reclaim_tasks(worker) && 0 != m_sleepers.load(std::memory_order_seq_cst))
+					this->wake_all();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void record_wait(Worker& worker, TaskNode const& node)
+	{
+		std::int64_t wait = clock_ns() - node.m_enqueued;
+		if (true == m_elastic.load(std::memory_order_relaxed) && wait > m_latency_ns.load(std::memory_order_relaxed)
+			&& false == m_overloaded.load(std::memory_order_relaxed))
+			m_overloaded.store(true, std::memory_order_relaxed);
+		if (true == m_metrics.load(std::memory_order_relaxed))
+			add(worker.m_wait[static_cast<std::size_t>(node.m_priority)][Histogram::bucket(wait > 0 ? wait : 0)], 1);
+	}
+
+	void record_run(Worker& worker, std::size_t priority, std::int64_t start, std::int64_t end)
+	{
+		if (true == m_metrics.load(std::memory_order_relaxed))
+		{
+			add(worker.m_busy_ns, end - start);
+			add(worker.m_run[priority][Histogram::bucket(end - start)], 1);
+		}
+		if (true == m_tracing.load(std::memory_order_relaxed))
+			worker.record_span(start, end, priority);
+	}
+
+	static std::int64_t clock_ns(void)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void start_supervisor(void)
+	{
+		if (true == m_elastic.load(std::memory_order_relaxed) && false == m_supervisor.joinable())
+		{
+			m_supervisor_stop = false;
+			m_supervisor = std::thread(&ThreadPool::supervise, this);
+		}
+	}
+
+	void stop_supervisor(std::unique_lock<std::mutex>& lock)
+	{
+		if (false == m_supervisor.joinable())
+			return;
+		m_supervisor_stop = true;
+		m_supervisor_cv.notify_all();
+		std::thread supervisor = std::move(m_supervisor);
+		lock.unlock();
+		supervisor.join();
+		lock.lock();
+	}
+
+	// Grows the pool when a task waited too long, as reported by the
+	// workers, or when tasks are pending while none completed for as long.
+	// Shrinks it when some worker stayed parked for the whole idle timeout.
+	void supervise(void)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto latency = std::chrono::nanoseconds(m_latency_ns.load(std::memory_order_relaxed));
+		auto tick = std::max<std::chrono::nanoseconds>(std::chrono::microseconds(100), std::min<std::chrono::nanoseconds>(latency / 2, m_idle_timeout / 4));
+		auto now = std::chrono::steady_clock::now();
+		auto progress = now;
+		auto idle_since = now;
+		bool idle = false;
+		std::uint64_t executed = this->executed_count();
+		while (false == m_supervisor_stop)
+		{
+			m_supervisor_cv.wait_for(lock, tick);
+			if (true == m_supervisor_stop)
+				break;
+			now = std::chrono::steady_clock::now();
+			if (std::uint64_t count = this->executed_count(); count != executed)
+			{
+				executed = count;
+				progress = now;
+			}
+
+			bool stalled = 0 != this->pending_count() && now - progress >= latency;
+			std::size_t capacity = m_capacity.load(std::memory_order_relaxed);
+			if ((true == m_overloaded.exchange(false, std::memory_order_relaxed) || true == stalled) && capacity < m_max_capacity)
+			{
+				m_capacity.store(capacity + 1, std::memory_order_relaxed);
+				try
+				{
+					this->launch_workers();
+				}
+				catch (std::exception const& e)
+				{
+					LOGF(Logger::ERROR, "Error occurred while growing ThreadPool: %s", e.what());
+				}
+				progress = now;
+				idle = false;
+				continue;
+			}
+
+			if (0 == m_sleepers.load(std::memory_order_relaxed))
+				idle = false;
+			else if (false == idle)
+			{
+				idle = true;
+				idle_since = now;
+			}
+			else if (now - idle_since >= m_idle_timeout && capacity > m_min_capacity)
+			{
+				m_capacity.store(capacity - 1, std::memory_order_relaxed);
+				this->wake_one();
+				idle_since = now;
+			}
+		}
+	}
+
+	std::uint64_t executed_count(void) const
+	{
+		std::uint64_t res = 0;
+		for (auto const& worker : m_workers)
+			res += worker->m_executed.load(std::memory_order_relaxed);
+		return res;
+	}
+
+	// The injection stacks of other nodes are only looked at once nothing
+	// is left on the worker's own node.
+	TaskNode* find_task(Worker& worker)
+	{
+		if (0 != m_deadlines.m_size.load(std::memory_order_relaxed))
+			if (TaskNode* node = this->take_deadline())
+				return node;
+		this->take_injected(worker, worker.m_node);
+		if (TaskNode* node = this->find_queued(worker))
+			return node;
+		for (std::size_t i = 1; i < m_node_count; ++i)
+			if (true == this->take_injected(worker, (worker.m_node + i) % m_node_count))
+				return this->find_queued(worker);
+		return nullptr;
+	}
+
+	TaskNode* find_queued(Worker& worker)
+	{
+		std::size_t order[priority_count];
+		this->priority_order(worker, order);
+		for (std::size_t priority : order)
+		{
+			if (0 == m_pending[priority].load(std::memory_order_relaxed))
+				continue;
+
+			TaskNode* node = worker.m_deques[priority].take();
+			if (nullptr == node)
+				node = this->steal(worker, priority);
+			if (nullptr != node)
+			{
+				if (policy_t::WEIGHTED == m_policy.load(std::memory_order_relaxed))
+				{
+					std::uint64_t pass = std::max(worker.m_pass[priority], worker.m_vtime);
+					worker.m_vtime = pass;
+					worker.m_pass[priority] = pass + (std::uint64_t(16) >> priority);
+				}
+				this->dequeued(priority);
+				return node;
+			}
+		}
+		return nullptr;
+	}
+
+	// Highest priority first, or under WEIGHTED, stride scheduling: lowest
+	// pass first, a priority back from idle starting at the current virtual
+	// time, and each task advancing the pass of its priority by 16 / weight.
+	void priority_order(Worker const& worker, std::size_t (&order)[priority_count]) const
+	{
+		for (std::size_t i = 0; i < priority_count; ++i)
+			order[i] = priority_count - 1 - i;
+		if (policy_t::WEIGHTED != m_policy.load(std::memory_order_relaxed))
+			return;
+		auto pass = [&worker](std::size_t priority) { return std::max(worker.m_pass[priority], worker.m_vtime); };
+		for (std::size_t i = 1; i < priority_count; ++i)
+			for (std::size_t j = i; j > 0 && pass(order[j]) < pass(order[j - 1]); --j)
+				std::swap(order[j], order[j - 1]);
+	}
+
+	void dequeued(std::size_t priority)
+	{
+		m_pending[priority].fetch_sub(1, std::memory_order_relaxed);
+		if (0 != m_sleepers.load(std::memory_order_relaxed) && 0 != this->pending_count())
+			this->wake_one();
+	}
+
+	// Tasks queued under EDF, shared by all the workers. Equal deadlines are
+	// served in submission order.
+	struct DeadlineQueue
+	{
+		struct Entry
+		{
+			std::int64_t m_deadline;
+			std::uint64_t m_sequence;
+			TaskNode* m_node;
+
+			bool operator<(Entry const& other) const
+			{
+				// std::push_heap() builds a max-heap
+				if (m_deadline != other.m_deadline)
+					return m_deadline > other.m_deadline;
+				return m_sequence > other.m_sequence;
+			}
+		};
+
+		std::mutex m_mutex;
+		std::vector<Entry> m_heap;
+		std::uint64_t m_sequence = 0;
+		std::atomic<std::size_t> m_size{0};
+	};
+
+	void push_deadlines(TaskNode* first, TaskNode* last)
+	{
+		std::int64_t now = clock_ns();
+		std::unique_lock<std::mutex> lock(m_deadlines.m_mutex);
+		for (TaskNode* node = first, * next; nullptr != node; node = next)
+		{
+			next = node == last ? nullptr : node->m_next;
+			std::int64_t deadline = 0 != node->m_deadline ? node->m_deadline
+				: now + m_budgets[static_cast<std::size_t>(node->m_priority)].load(std::memory_order_relaxed);
+			m_deadlines.m_heap.push_back({ deadline, m_deadlines.m_sequence++, node });
+			std::push_heap(m_deadlines.m_heap.begin(), m_deadlines.m_heap.end());
+		}
+		m_deadlines.m_size.store(m_deadlines.m_heap.size(), std::memory_order_relaxed);
+	}
+
+	TaskNode* take_deadline(void)
+	{
+		TaskNode* node = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(m_deadlines.m_mutex);
+			if (true == m_deadlines.m_heap.empty())
+				return nullptr;
+			std::pop_heap(m_deadlines.m_heap.begin(), m_deadlines.m_heap.end());
+			node = m_deadlines.m_heap.back().m_node;
+			m_deadlines.m_heap.pop_back();
+			m_deadlines.m_size.store(m_deadlines.m_heap.size(), std::memory_order_relaxed);
+		}
+		this->dequeued(static_cast<std::size_t>(node->m_priority));
+		return node;
+	}
+
+	// Moves the whole injection stack of a node, oldest first, into the
+	// worker's deques. Returns false when it was empty.
+	bool take_injected(Worker& worker, std::size_t node_index)
+	{
+		std::atomic<TaskNode*>& injected = m_nodes[node_index].m_injected;
+		if (nullptr == injected.load(std::memory_order_relaxed))
+			return false;
+		TaskNode* node = injected.exchange(nullptr, std::memory_order_acquire);
+		TaskNode* ordered = nullptr;
+		while (nullptr != node)
+		{
+			TaskNode* next = node->m_next;
+			node->m_next = ordered;
+			ordered = node;
+			node = next;
+		}
+		bool res = nullptr != ordered;
+		while (nullptr != ordered)
+		{
+			TaskNode* next = ordered->m_next;
+			worker.m_deques[static_cast<std::size_t>(ordered->m_priority)].push(ordered);
+			ordered = next;
+		}
+		return res;
+	}
+
+	// Tries the workers of the thief's node first, from a random one, then
+	// all the others.
+	TaskNode* steal(Worker& worker, std::size_t priority)
+	{
+		std::size_t count = m_table_size.load(std::memory_order_acquire);
+		Worker* const* workers = m_table.load(std::memory_order_acquire);
+		if (count <= worker.m_node)
+			return nullptr;
+		std::size_t local = (count - worker.m_node + m_node_count - 1) / m_node_count;
+		std::size_t first = worker.next_random();
+		for (std::size_t i = 0; i < local; ++i)
+		{
+			Worker& victim = *workers[worker.m_node + (first + i) % local * m_node_count];
+			if (&victim == &worker)
+				continue;
+			if (TaskNode* node = this->steal_from(worker, victim, priority))
+				return node;
+		}
+		if (1 == m_node_count)
+			return nullptr;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			Worker& victim = *workers[(first + i) % count];
+			if (victim.m_node == worker.m_node)
+				continue;
+			if (TaskNode* node = this->steal_from(worker, victim, priority))
+				return node;
+		}
+		return nullptr;
+	}
+
+	TaskNode* steal_from(Worker& worker, Worker& victim, std::size_t priority)
+	{
+		add(worker.m_steal_attempts, 1);
+		TaskNode* node = victim.m_deques[priority].steal();
+		if (nullptr != node)
+			add(worker.m_steals, 1);
+		return node;
+	}
+
+	// Node of the CPU the calling thread runs on.
+	std::size_t current_node(void) const
+	{
+		if (1 == m_node_count)
+			return 0;
+		int cpu = sched_getcpu();
+		if (cpu < 0 || static_cast<std::size_t>(cpu) >= m_cpu_node.size())
+			return 0;
+		return m_cpu_node[cpu];
+	}
+
+	// Pushes the chain first..last, linked through m_next, with a single CAS.
+	void inject(std::size_t node, TaskNode* first, TaskNode* last)
+	{
+		std::atomic<TaskNode*>& injected = m_nodes[node].m_injected;
+		last->m_next = injected.load(std::memory_order_relaxed);
+		while (false == injected.compare_exchange_weak(last->m_next, first, std::memory_order_release, std::memory_order_relaxed))
+			;
+	}
+
+	// Puts the tasks left in the deques of the stopped workers back into the
+	// injection stacks of their nodes, in their original order.
+	void reclaim_tasks(void)
+	{
+		for (auto& worker : m_workers)
+			this->reclaim_tasks(*worker);
+	}
+
+	// Deques are drained oldest first into one chain, newest on top as if
+	// submitted again one by one, so that take_injected() restores their
+	// order.
+	std::size_t reclaim_tasks(Worker& worker)
+	{
+		std::size_t res = 0;
+		TaskNode* first = nullptr;
+		TaskNode* last = nullptr;
+		for (auto& deque : worker.m_deques)
+		{
+			while (TaskNode* node = deque.take())
+			{
+				node->m_next = first;
+				first = node;
+				if (nullptr == last)
+					last = node;
+				++res;
+			}
+		}
+		if (nullptr != first)
+			this->inject(worker.m_node, first, last);
+		return res;
+	}
+
+	std::int64_t pending_count(void) const
+	{
+		std::int64_t res = 0;
+		for (auto const& pending : m_pending)
+			res += pending.load(std::memory_order_seq_cst);
+		return res;
+	}
+
+	static void cpu_relax(void)
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield");
+#endif
+	}
+
+	// Idle strategy: spin_rounds attempts separated by exponentially growing
+	// pause loops, then yield_rounds attempts after yielding the CPU, then
+	// park. Returns null when parking ended without finding a task.
+	TaskNode* wait_for_task(Worker& worker)
+	{
+		static constexpr std::size_t spin_rounds = 10;
+		static constexpr std::size_t yield_rounds = 4;
+
+		for (std::size_t round = 0; round < spin_rounds; ++round)
+		{
+			for (std::size_t i = 0; i < (std::size_t(1) << round); ++i)
+				cpu_relax();
+			if (TaskNode* node = this->find_task(worker))
+				return node;
+		}
+		for (std::size_t round = 0; round < yield_rounds; ++round)
+		{
+			std::this_thread::yield();
+			if (TaskNode* node = this->find_task(worker))
+				return node;
+		}
+		if (false == m_stop_requested.load(std::memory_order_acquire))
+			this->park();
+		return nullptr;
+	}
+
+	// A worker only sleeps after announcing itself in m_sleepers and seeing no
+	// pending task; submitters bump m_pending before checking m_sleepers, and
+	// only make the futex call when a worker is parked. Reading the epoch
+	// first makes a wake-up racing with the checks end the wait at once.
+	void park(void)
+	{
+		std::uint32_t epoch = m_wake_epoch.load(std::memory_order_acquire);
+		m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+		if (false == m_stop_requested.load(std::memory_order_seq_cst) && 0 == this->pending_count()
+			&& m_active.load(std::memory_order_relaxed) <= m_capacity.load(std::memory_order_relaxed))
+			m_wake_epoch.wait(epoch, std::memory_order_acquire);
+		m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void wake_one(void)
+	{
+		m_wake_epoch.fetch_add(1, std::memory_order_release);
+		m_wake_epoch.notify_one();
+	}
+
+	void wake_all(void)
+	{
+		m_wake_epoch.fetch_add(1, std::memory_order_release);
+		m_wake_epoch.notify_all();
+	}
+
+	template<class F>
+	void prepare_task_internal(F&& task, ThreadPool::priority_t priority, std::int64_t deadline = 0)
+	{
+		TaskNode* node = make_node(std::forward<F>(task), priority);
+		node->m_deadline = deadline;
+		this->enqueue_chain(node, node, 1, priority);
+	}
+
+	// Enqueues make(0), ..., make(count - 1) as one chain: one update of the
+	// pending counter, one push and at most one wake-up call.
+	template<class Make>
+	void enqueue_bulk(std::size_t count, Make&& make, priority_t priority)
+	{
+		TaskNode* first = nullptr;
+		TaskNode* last = nullptr;
+		try
+		{
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				TaskNode* node = make_node(make(i), priority);
+				node->m_next = first;
+				first = node;
+				if (nullptr == last)
+					last = node;
+			}
+		}
+		catch (...)
+		{
+			while (nullptr != first)
+			{
+				TaskNode* next = first->m_next;
+				free_node(first);
+				first = next;
+			}
+			throw;
+		}
+		if (0 != count)
+			this->enqueue_chain(first, last, count, priority);
+	}
+
+	// The chain is linked newest first, as the injection stack expects.
+	void enqueue_chain(TaskNode* first, TaskNode* last, std::size_t count, priority_t priority)
+	{
+		std::size_t index = static_cast<std::size_t>(priority);
+		if (true == m_elastic.load(std::memory_order_relaxed) || true == m_metrics.load(std::memory_order_relaxed))
+		{
+			std::int64_t now = clock_ns();
+			for (TaskNode* node = first; ; node = node->m_next)
+			{
+				node->m_enqueued = now;
+				if (node == last)
+					break;
+			}
+		}
+		m_pending[index].fetch_add(count, std::memory_order_seq_cst);
+		if (policy_t::EDF == m_policy.load(std::memory_order_relaxed))
+			this->push_deadlines(first, last);
+		else if (nullptr != this_worker && this == this_worker->m_pool)
+		{
+			for (TaskNode* node = first, * next; nullptr != node; node = next)
+			{
+				next = node == last ? nullptr : node->m_next;
+				this_worker->m_deques[index].push(node);
+			}
+		}
+		else
+			this->inject(this->current_node(), first, last);
+		if (0 != m_sleepers.load(std::memory_order_seq_cst))
+		{
+			if (1 == count)
+				this->wake_one();
+			else
+				this->wake_all();
+		}
+	}
+
+	// Shared state of one bulk submission: run(chunk) is called once per
+	// chunk, and the last chunk to finish fulfils the promise with complete(),
+	// or with the first exception thrown. Chunks starting after a failure are
+	// skipped.
+	template<class R, class Run, class Complete>
+	class BulkState
+	{
+		Run m_run;
+		Complete m_complete;
+		std::atomic<std::size_t> m_remaining;
+		std::atomic<bool> m_failed;
+		std::exception_ptr m_error;
+		std::promise<R> m_promise;
+
+	public:
+		BulkState(std::size_t chunks, Run run, Complete complete)
+			: m_run(std::move(run))
+			, m_complete(std::move(complete))
+			, m_remaining(chunks)
+			, m_failed(false)
+			, m_promise(std::allocator_arg, PoolAllocator<R>())
+		{
+		}
+
+		std::future<R> get_future(void)
+		{
+			return m_promise.get_future();
+		}
+
+		void run(std::size_t chunk)
+		{
+			if (false == m_failed.load(std::memory_order_relaxed))
+			{
+				try
+				{
+					m_run(chunk);
+				}
+				catch (...)
+				{
+					if (false == m_failed.exchange(true, std::memory_order_relaxed))
+						m_error = std::current_exception();
+				}
+			}
+			if (1 == m_remaining.fetch_sub(1, std::memory_order_acq_rel))
+				this->complete();
+		}
+
+		void complete(void)
+		{
+			if (true == m_failed.load(std::memory_order_relaxed))
+				return m_promise.set_exception(m_error);
+			try
+			{
+				if constexpr (std::is_void_v<R>)
+				{
+					m_complete();
+					m_promise.set_value();
+				}
+				else
+					m_promise.set_value(m_complete());
+			}
+			catch (...)
+			{
+				m_promise.set_exception(std::current_exception());
+			}
+		}
+	};
+
+	// Submits chunks tasks calling run(chunk); see BulkState.
+	template<class R, class Run, class Complete>
+	std::future<R> submit_chunks(std::size_t chunks, Run run, Complete complete, priority_t priority)
+	{
+		using State = BulkState<R, Run, Complete>;
+		auto state = std::allocate_shared<State>(PoolAllocator<State>(), chunks, std::move(run), std::move(complete));
+		std::future<R> future = state->get_future();
+		if (0 == chunks)
+			state->complete();
+		else
+			this->enqueue_bulk(chunks, [&state](std::size_t chunk) { return [state, chunk]() { state->run(chunk); }; }, priority);
+		return future;
+	}
+
+	// Runs fn(at(i)) for i in [0, size), in chunks of grain_for(size, 0).
+	template<class At, class F>
+	std::future<void> submit_items(std::size_t size, At at, F fn, priority_t priority)
+	{
+		std::size_t grain = this->grain_for(size, 0);
+		auto run = [at = std::move(at), fn = std::move(fn), size, grain](std::size_t chunk) mutable
+		{
+			for (std::size_t i = chunk * grain, last = std::min(size, i + grain); i < last; ++i)
+				fn(at(i));
+		};
+		return this->submit_chunks<void>((size + grain - 1) / grain, std::move(run), [](){}, priority);
+	}
+
+	// A zero grain picks one giving each worker about four chunks.
+	std::size_t grain_for(std::size_t size, std::size_t grain) const
+	{
+		if (0 != grain)
+			return grain;
+		return std::max<std::size_t>(1, size / (4 * m_capacity.load(std::memory_order_relaxed)));
+	}
+
+	mutable std::mutex m_mutex;
+	// Worker slots, and their threads, only touched with m_mutex held
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::vector<std::thread> m_threads;
+	std::unique_ptr<Node[]> m_nodes;
+	std::atomic<std::int64_t> m_pending[priority_count];
+	std::atomic<std::size_t> m_sleepers;
+	std::atomic<std::uint32_t> m_wake_epoch;
+	std::atomic_bool m_stop_requested;
+	std::atomic<std::size_t> m_capacity;
+	bool m_stopped;
+	placement_t m_placement;
+	std::size_t m_node_count;
+	std::vector<std::vector<int>> m_topology;
+	std::vector<std::size_t> m_cpu_node;
+	// Snapshot of m_workers for thieves, see publish_workers()
+	std::vector<std::unique_ptr<Worker*[]>> m_tables;
+	std::atomic<Worker* const*> m_table;
+	std::atomic<std::size_t> m_table_size;
+	std::atomic<std::size_t> m_active;
+	std::atomic<bool> m_elastic;
+	std::atomic<bool> m_overloaded;
+	std::atomic<std::int64_t> m_latency_ns;
+	std::size_t m_min_capacity;
+	std::size_t m_max_capacity;
+	std::chrono::milliseconds m_idle_timeout;
+	std::thread m_supervisor;
+	std::condition_variable m_supervisor_cv;
+	bool m_supervisor_stop;
+	std::atomic<policy_t> m_policy;
+	std::atomic<bool> m_metrics;
+	std::atomic<bool> m_tracing;
+	std::atomic<std::int64_t> m_budgets[priority_count];
+	DeadlineQueue m_deadlines;
+	// measured by the workers of previous runs
+	Metrics m_retired;
+	std::vector<Span> m_retired_spans;
+	std::int64_t m_trace_origin;
+};
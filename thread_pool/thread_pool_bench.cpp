@@ -0,0 +1,295 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <queue>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <logger.h>
+#include "thread_pool.h"
+
+// Throughput and latency of ThreadPool, against BaselinePool, the design
+// it replaced: one mutex, one priority_queue and one condition_variable
+// shared by every worker and submitter.
+//
+// usage: thread_pool_bench [tasks] [max threads]
+
+namespace
+{
+
+class BaselinePool final
+{
+	struct Task
+	{
+		std::function<void()> m_task;
+		ThreadPool::priority_t m_priority;
+
+		bool operator<(Task const& task) const noexcept
+		{
+			return this->m_priority < task.m_priority;
+		}
+	};
+
+public:
+	explicit BaselinePool(std::size_t capacity)
+		: m_stop_requested(false)
+	{
+		for (std::size_t i = 0; i < capacity; ++i)
+		{
+			m_threads.emplace_back([this]()
+				{
+					while (true)
+					{
+						Task task;
+						{
+							std::unique_lock<std::mutex> ul(m_mutex);
+							m_cv.wait(ul, [this]() { return true == m_stop_requested || false == m_queue.empty(); });
+							if (true == m_queue.empty())
+								return;
+							task = m_queue.top();
+							m_queue.pop();
+						}
+						task.m_task();
+					}
+				});
+		}
+	}
+
+	~BaselinePool(void)
+	{
+		{
+			std::lock_guard<std::mutex> lg(m_mutex);
+			m_stop_requested = true;
+		}
+		m_cv.notify_all();
+		for (auto& thread : m_threads)
+			thread.join();
+	}
+
+	void submit(std::function<void()> task, ThreadPool::priority_t priority)
+	{
+		{
+			std::lock_guard<std::mutex> lg(m_mutex);
+			m_queue.push(Task{ std::move(task), priority });
+		}
+		m_cv.notify_one();
+	}
+
+private:
+	std::priority_queue<Task> m_queue;
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_stop_requested;
+};
+
+using bench_clock = std::chrono::steady_clock;
+
+void wait_for(std::atomic<std::size_t> const& done, std::size_t count)
+{
+	while (done.load(std::memory_order_acquire) < count)
+		std::this_thread::yield();
+}
+
+double per_second(std::size_t count, bench_clock::time_point begin)
+{
+	std::chrono::duration<double> elapsed = bench_clock::now() - begin;
+	return count / elapsed.count();
+}
+
+// Short tasks submitted from outside the pool, then from inside it, where
+// ThreadPool pushes to the worker's own deque.
+void short_tasks(std::size_t tasks, std::size_t max_threads)
+{
+	std::cout << "short tasks, tasks/s\nthreads\tbaseline external\tbaseline nested\tpool external\tpool nested" << std::endl;
+	for (std::size_t threads = 1; threads <= max_threads; threads *= 2)
+	{
+		std::atomic<std::size_t> done = 0;
+		std::function<void()> work = [&done]() { done.fetch_add(1, std::memory_order_release); };
+		double res[4];
+		{
+			BaselinePool pool(threads);
+			auto begin = bench_clock::now();
+			for (std::size_t i = 0; i < tasks; ++i)
+				pool.submit(work, ThreadPool::priority_t::MEDIUM);
+			wait_for(done, tasks);
+			res[0] = per_second(tasks, begin);
+
+			done = 0;
+			begin = bench_clock::now();
+			pool.submit([&]() {
+				for (std::size_t i = 0; i < tasks; ++i)
+					pool.submit(work, ThreadPool::priority_t::MEDIUM);
+			}, ThreadPool::priority_t::MEDIUM);
+			wait_for(done, tasks);
+			res[1] = per_second(tasks, begin);
+		}
+		{
+			ThreadPool pool(threads);
+			pool.start();
+			done = 0;
+			auto begin = bench_clock::now();
+			for (std::size_t i = 0; i < tasks; ++i)
+				pool.prepare_task(work, ThreadPool::priority_t::MEDIUM);
+			wait_for(done, tasks);
+			res[2] = per_second(tasks, begin);
+
+			done = 0;
+			begin = bench_clock::now();
+			std::function<void()> fan_out = [&]() {
+				for (std::size_t i = 0; i < tasks; ++i)
+					pool.prepare_task(work, ThreadPool::priority_t::MEDIUM);
+			};
+			pool.prepare_task(fan_out, ThreadPool::priority_t::MEDIUM);
+			wait_for(done, tasks);
+			res[3] = per_second(tasks, begin);
+		}
+		std::cout << threads;
+		for (double r : res)
+			std::cout << '\t' << static_cast<std::uint64_t>(r);
+		std::cout << std::endl;
+	}
+}
+
+// Chunked data processing: one prepare_task() per item, against
+// submit_bulk() and parallel_for(), which enqueue every task in one
+// operation and return a single completion handle.
+void bulk(std::size_t items, std::size_t threads)
+{
+	std::vector<std::uint64_t> data(items, 0);
+	ThreadPool pool(threads);
+	pool.start();
+	std::cout << "bulk submission of " << items << " items, " << threads << " threads, items/s" << std::endl;
+
+	std::atomic<std::size_t> done = 0;
+	std::function<void(std::size_t)> work = [&data, &done](std::size_t i) {
+		data[i] += i;
+		done.fetch_add(1, std::memory_order_release);
+	};
+	auto begin = bench_clock::now();
+	for (std::size_t i = 0; i < items; ++i)
+		pool.prepare_task(work, ThreadPool::priority_t::MEDIUM, i);
+	wait_for(done, items);
+	std::cout << "prepare_task loop\t" << static_cast<std::uint64_t>(per_second(items, begin)) << std::endl;
+
+	std::vector<std::size_t> indices(items);
+	for (std::size_t i = 0; i < items; ++i)
+		indices[i] = i;
+	begin = bench_clock::now();
+	pool.submit_bulk(indices, [&data](std::size_t i) { data[i] += i; }).get();
+	std::cout << "submit_bulk\t" << static_cast<std::uint64_t>(per_second(items, begin)) << std::endl;
+
+	begin = bench_clock::now();
+	pool.parallel_for(std::size_t(0), items, 0, [&data](std::size_t i) { data[i] += i; }).get();
+	std::cout << "parallel_for\t" << static_cast<std::uint64_t>(per_second(items, begin)) << std::endl;
+}
+
+// Items going through a chain of stages: waiting on each stage with get()
+// before submitting the next, against then() chains joined by when_all()
+// and a TaskGraph of one chain per item, where nothing blocks.
+void pipelines(std::size_t items, std::size_t threads)
+{
+	static constexpr std::size_t stages = 8;
+	auto stage = [](std::uint64_t x) { return x * 3 + 1; };
+	ThreadPool pool(threads);
+	pool.start();
+	std::cout << "pipelines of " << stages << " stages over " << items << " items, " << threads << " threads, items/s" << std::endl;
+
+	auto begin = bench_clock::now();
+	for (std::size_t i = 0; i < items; ++i)
+	{
+		std::uint64_t value = i;
+		for (std::size_t s = 0; s < stages; ++s)
+			value = pool.submit(stage, ThreadPool::priority_t::MEDIUM, value).get();
+	}
+	std::cout << "blocking get()\t" << static_cast<std::uint64_t>(per_second(items, begin)) << std::endl;
+
+	begin = bench_clock::now();
+	std::vector<ThreadPool::Future<std::uint64_t>> chains;
+	chains.reserve(items);
+	for (std::size_t i = 0; i < items; ++i)
+	{
+		auto future = pool.submit(stage, ThreadPool::priority_t::MEDIUM, std::uint64_t(i));
+		for (std::size_t s = 1; s < stages; ++s)
+			future = future.then(stage);
+		chains.push_back(std::move(future));
+	}
+	pool.when_all(std::move(chains)).get();
+	std::cout << "then() chains\t" << static_cast<std::uint64_t>(per_second(items, begin)) << std::endl;
+
+	std::vector<std::uint64_t> values(items);
+	ThreadPool::TaskGraph graph;
+	for (std::size_t i = 0; i < items; ++i)
+	{
+		ThreadPool::TaskGraph::node_t previous = graph.add([&values, i]() { values[i] = i; });
+		for (std::size_t s = 1; s < stages; ++s)
+		{
+			ThreadPool::TaskGraph::node_t next = graph.add([&values, i, stage]() { values[i] = stage(values[i]); });
+			graph.precede(previous, next);
+			previous = next;
+		}
+	}
+	begin = bench_clock::now();
+	graph.run(pool).get();
+	std::cout << "TaskGraph\t" << static_cast<std::uint64_t>(per_second(items, begin)) << std::endl;
+}
+
+// Submit-to-start latency of one task at a time, back to back and after
+// idle gaps long enough for the workers to park.
+template<class Submit>
+void latencies(char const* name, std::size_t samples, std::chrono::microseconds gap, Submit submit)
+{
+	std::vector<std::int64_t> res(samples);
+	for (std::size_t i = 0; i < samples; ++i)
+	{
+		std::atomic<bool> started = false;
+		auto begin = bench_clock::now();
+		submit([&res, &started, begin, i]() {
+			res[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - begin).count();
+			started.store(true, std::memory_order_release);
+		});
+		while (false == started.load(std::memory_order_acquire))
+			std::this_thread::yield();
+		if (0 != gap.count())
+			std::this_thread::sleep_for(gap);
+	}
+	std::sort(res.begin(), res.end());
+	std::cout << name << '\t' << gap.count() << "us\t" << res[samples / 2] << '\t' << res[samples * 9 / 10] << '\t' << res[samples * 99 / 100] << '\t' << res.back() << std::endl;
+}
+
+void wake_latency(std::size_t samples, std::size_t threads)
+{
+	std::cout << "submit-to-start latency, " << threads << " threads, ns\npool\tgap\tp50\tp90\tp99\tmax" << std::endl;
+	for (auto gap : { std::chrono::microseconds(0), std::chrono::microseconds(200) })
+	{
+		{
+			BaselinePool pool(threads);
+			latencies("baseline", samples, gap, [&pool](std::function<void()> task) { pool.submit(std::move(task), ThreadPool::priority_t::MEDIUM); });
+		}
+		{
+			ThreadPool pool(threads);
+			pool.start();
+			latencies("pool", samples, gap, [&pool](std::function<void()> task) { pool.prepare_task(task, ThreadPool::priority_t::MEDIUM); });
+		}
+	}
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	Logger logger(nullptr, false, false);
+	std::size_t tasks = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+	std::size_t max_threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 64;
+
+	short_tasks(tasks, max_threads);
+	bulk(tasks * 10, std::min<std::size_t>(max_threads, std::thread::hardware_concurrency()));
+	pipelines(tasks / 10, std::min<std::size_t>(max_threads, std::thread::hardware_concurrency()));
+	wake_latency(std::max<std::size_t>(tasks / 100, 100), std::min<std::size_t>(max_threads, std::thread::hardware_concurrency()));
+	return 0;
+}
@@ -0,0 +1,148 @@
+#include <iostream>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <logger.h>
+#include "thread_pool.h"
+
+// Regression checks for ThreadPool; returns non-zero on the first failure.
+
+namespace
+{
+
+int failures = 0;
+
+void check(bool condition, char const* what)
+{
+	if (false == condition)
+	{
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+// Every heap allocation of the program, counted by the operators below.
+std::atomic<std::size_t> allocations = 0;
+
+void* allocate(std::size_t size, std::size_t alignment)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	size = 0 == size ? 1 : size;
+	void* res = alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? std::malloc(size) : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	if (nullptr == res)
+		throw std::bad_alloc();
+	return res;
+}
+
+// Small closures are stored inline and promises come from the block pools,
+// so that once warmed up, submitting allocates nothing.
+void steady_state_submissions_do_not_allocate(void)
+{
+	static constexpr int count = 10000;
+	ThreadPool tp(4);
+	tp.start();
+	std::function<int(int, int)> fsum = [](int x, int y) {
+		return x + y;
+	};
+	auto submit = [&tp, &fsum](int count) {
+		int res = 0;
+		for (int i = 0; i < count; ++i)
+			res += tp.prepare_task(fsum, ThreadPool::priority_t::MEDIUM, i, 1)->get();
+		return res;
+	};
+
+	// A burst first grows the pools past what the per-thread caches can
+	// hold, so that a thread running dry always finds freed blocks.
+	{
+		std::vector<std::future<int>> burst;
+		burst.reserve(count);
+		for (int i = 0; i < count; ++i)
+			burst.push_back(std::move(*tp.prepare_task(fsum, ThreadPool::priority_t::MEDIUM, i, 1)));
+		for (auto& future : burst)
+			future.get();
+	}
+	submit(count);
+
+	std::size_t before = allocations.load(std::memory_order_relaxed);
+	int sum = submit(count);
+	std::size_t allocated = allocations.load(std::memory_order_relaxed) - before;
+	check(count * (count + 1) / 2 == sum, "every submission runs");
+	if (0 != allocated)
+		std::cerr << count << " submissions made " << allocated << " allocations" << std::endl;
+	check(0 == allocated, "steady-state submissions do not allocate");
+}
+
+}
+
+void* operator new(std::size_t size)
+{
+	return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new[](std::size_t size)
+{
+	return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept
+{
+	std::free(ptr);
+}
+
+int main(int, char**)
+{
+	Logger logger(nullptr, false, false);
+	steady_state_submissions_do_not_allocate();
+	if (0 != failures)
+		return 1;
+	std::cout << "thread_pool_test passed" << std::endl;
+	return 0;
+}
@@ -23,7 +23,7 @@ int main (int argc, char ** argv)
 
 	if(2 != argc)
 	{
-		Logger::logf(Logger::ERROR, __FILE__, __LINE__, "Error: Invalid arguments\n");
+		LOGF(Logger::ERROR, "Error: Invalid arguments\n");
 		exit(EXIT_FAILURE);
 	}
 